@@ -30,6 +30,9 @@ CMusic Music;
 uint8_t const CMusic::SCI_OPCODE_WRITE = 0x02;
 uint8_t const CMusic::SCI_OPCODE_READ  = 0x03;
 
+CMusic* CMusic::_instances     = 0;
+CMusic* CMusic::_instanceFirst = 0;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -39,12 +42,14 @@ uint8_t const CMusic::SCI_OPCODE_READ  = 0x03;
 class CMusic::Register
 {
 private:
-  template<uint8_t ADDRESS, class TWriteUntil>
+  template<uint8_t ADDRESS, class TWriteUntil, class TShadow>
   class Binding
   {
   public:
     typedef uint16_t Value;
 
+    enum { address = ADDRESS };
+
     static uint16_t read(CMusic& music);
     static void write(CMusic& music, uint16_t value);
   };
@@ -54,37 +59,125 @@ private:
     // empty
   };
 
-  class WriteUntilPin
+  template<unsigned long TICKS>
+  class WriteUntilPinOrTimeout
   {
   public:
     static void wait(CMusic& music);
   };
 
-  template<unsigned long TICKS>
-  class WriteUntilPinOrTimeout
+  // Registers that only the host changes (apart from a few bits that the
+  // chip clears by itself) are shadowed in CMusic::_shadow, so that reads
+  // can be answered and redundant writes skipped without any SCI traffic.
+  // A register is only read back from the chip while one of its volatile
+  // bits is set in its shadow.
+
+  class ShadowNone
   {
   public:
-    static void wait(CMusic& music);
+    static bool lookup(CMusic& music, uint16_t& value);
+    static bool redundant(CMusic& music, uint16_t value);
+    static void store(CMusic& music, uint16_t value);
+  };
+
+  template<uint8_t SLOT, uint16_t BITS_VOLATILE>
+  class Shadow
+  {
+  public:
+    static bool lookup(CMusic& music, uint16_t& value);
+    static bool redundant(CMusic& music, uint16_t value);
+    static void store(CMusic& music, uint16_t value);
+  };
+
+  enum {
+    SHADOW_MODE,
+    SHADOW_CLOCKF,
+    SHADOW_VOL,
   };
 
 public:
+  static void invalidate(CMusic& music);
+
+  // Several words written to the same register in a single SCI transaction,
+  // which saves the opcode and address for all but the first. Writes to
+  // SCI_WRAM auto-increment SCI_WRAMADDR, so that's how WRAM is filled.
+
+  class Burst
+  {
+  public:
+    Burst(CMusic& music, uint8_t address);
+    ~Burst();
+
+    void write(uint16_t value);
+
+  private:
+    CMusic& _music;
+  };
+
+  // Several words read from the same register in a single SPI transaction.
+  // The VS1053b has no multiple-read mode, so each word is still an SCI
+  // read of its own, but reads from SCI_WRAM auto-increment SCI_WRAMADDR
+  // just like writes do, so that's how WRAM is read in bulk.
+
+  class ReadBurst
+  {
+  public:
+    ReadBurst(CMusic& music, uint8_t address);
+    ~ReadBurst();
+
+    uint16_t read();
+
+  private:
+    CMusic& _music;
+    uint8_t _address;
+  };
+
   static uint16_t const SM_DIFF          = (0x1 <<  0);
   static uint16_t const SM_RESET         = (0x1 <<  2);
   static uint16_t const SM_CANCEL        = (0x1 <<  3);
   static uint16_t const SM_EARSPEAKER_LO = (0x1 <<  4);
   static uint16_t const SM_EARSPEAKER_HI = (0x1 <<  7);
   static uint16_t const SM_SDINEW        = (0x1 << 11);
-
-  typedef Binding<0x0, WriteUntilPinOrTimeout< 80> > SCI_MODE;
-  typedef Binding<0x1, WriteUntilPinOrTimeout< 80> > SCI_STATUS;
-  typedef Binding<0x3, WriteUntilPin               > SCI_CLOCKF;
-  typedef Binding<0x4, WriteUntilPinOrTimeout<100> > SCI_DECODE_TIME;
-  typedef Binding<0x5, WriteUntilPin               > SCI_AUDATA;
-  typedef Binding<0x6, WriteUntilPinOrTimeout<100> > SCI_WRAM;
-  typedef Binding<0x7, WriteUntilPinOrTimeout<100> > SCI_WRAMADDR;
-  typedef Binding<0x8, WriteDisabled               > SCI_HDAT0;
-  typedef Binding<0x9, WriteDisabled               > SCI_HDAT1;
-  typedef Binding<0xB, WriteUntilPinOrTimeout< 80> > SCI_VOL;
+  static uint16_t const SM_ADPCM         = (0x1 << 12);
+  static uint16_t const SM_LINE1         = (0x1 << 14);
+
+  // The clock for decoding, and the bare XTALI clock for powering down.
+
+  static uint16_t const CLOCKF_PLAY =
+      0x4  << 13    // SC_MULT = 0b100  (set clock multiplier to 3.5)
+    | 0x3  << 11    // SC_ADD  = 0b11   (set clock modification by decoder allowed to max)
+    | 0x00 <<  0;   // SC_FREQ = 0      (indicate XTALI frequency is default 12.288 MHz)
+
+  static uint16_t const CLOCKF_POWERDOWN =
+      0x0  << 13    // SC_MULT = 0b000  (set clock multiplier to 1.0)
+    | 0x0  << 11    // SC_ADD  = 0b00   (set no clock modification by decoder)
+    | 0x00 <<  0;   // SC_FREQ = 0      (indicate XTALI frequency is default 12.288 MHz)
+
+  // Timeouts in XTALI cycles. Switching clocks or sample rates takes the
+  // VS1053b much longer than any other write, but a chip that never
+  // raises DREQ again mustn't keep loop() from getting to its reset
+  // timeout.
+
+  typedef Binding<0x0, WriteUntilPinOrTimeout<  80>, Shadow<SHADOW_MODE, SM_RESET | SM_CANCEL> > SCI_MODE;
+  typedef Binding<0x1, WriteUntilPinOrTimeout<  80>, ShadowNone                            > SCI_STATUS;
+  typedef Binding<0x3, WriteUntilPinOrTimeout<6000>, Shadow<SHADOW_CLOCKF, 0>              > SCI_CLOCKF;
+  typedef Binding<0x4, WriteUntilPinOrTimeout< 100>, ShadowNone                            > SCI_DECODE_TIME;
+  typedef Binding<0x5, WriteUntilPinOrTimeout<3200>, ShadowNone                            > SCI_AUDATA;
+  typedef Binding<0x6, WriteUntilPinOrTimeout< 100>, ShadowNone                            > SCI_WRAM;
+  typedef Binding<0x7, WriteUntilPinOrTimeout< 100>, ShadowNone                            > SCI_WRAMADDR;
+  typedef Binding<0x8, WriteDisabled,                ShadowNone                            > SCI_HDAT0;
+  typedef Binding<0x9, WriteDisabled,                ShadowNone                            > SCI_HDAT1;
+  typedef Binding<0xB, WriteUntilPinOrTimeout<  80>, Shadow<SHADOW_VOL, 0>                 > SCI_VOL;
+  typedef Binding<0xC, WriteUntilPinOrTimeout<  80>, ShadowNone                            > SCI_AICTRL0;
+  typedef Binding<0xD, WriteUntilPinOrTimeout<  80>, ShadowNone                            > SCI_AICTRL1;
+  typedef Binding<0xE, WriteUntilPinOrTimeout<  80>, ShadowNone                            > SCI_AICTRL2;
+  typedef Binding<0xF, WriteUntilPinOrTimeout<  80>, ShadowNone                            > SCI_AICTRL3;
+
+  // VLSI's PCM mixer plugin takes over two of the application registers
+  // while it's running.
+
+  typedef SCI_AICTRL1 MIXER_FREE;  // room in its FIFO, in samples
+  typedef SCI_AICTRL2 MIXER_DATA;  // the next sample to mix in
 };
 
 
@@ -126,6 +219,14 @@ public:
   typedef Binding<0x1E05, uint16_t> parametric_byteRate;
   typedef Binding<0x1E06, uint16_t> parametric_endFillByte;
   typedef Binding<0x1E27, uint32_t> parametric_positionMsec;
+  typedef Binding<0x1E29, uint16_t> parametric_resync;
+
+  // VLSI's spectrum analyzer plugin: the number of bands, then one word
+  // per band with the current level in bits 5:0 and the peak in bits 11:6
+
+  typedef Binding<0x1802, uint16_t> spectrum_nBands;
+
+  static uint16_t const spectrum_bands = 0x1804;
 
   typedef Binding<0xC017, uint16_t> GPIO_DDR;
   typedef Binding<0xC040, uint16_t> I2S_CONFIG;
@@ -134,434 +235,2952 @@ public:
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  CMusic::Register (implementation)
+//  CMusic::Lock
+//
+//  Sets _lock for as long as it's in scope. The flag is volatile, but the
+//  buffer and playback state it guards aren't, so compiler barriers keep
+//  their accesses from being moved out from under it.
 //
 
-inline void CMusic::Register::WriteUntilPin::wait(CMusic& music)
-{
-  while (music._pinRequest == LOW);
-}
-
-
-template<unsigned long TICKS>
-inline void CMusic::Register::WriteUntilPinOrTimeout<TICKS>::wait(CMusic& music)
+class CMusic::Lock
 {
-  static unsigned long const microsPerIncrement =  4;
-  static unsigned long const ticksPerMicro      = 12;
-  static unsigned long const ticksPerIncrement  = ticksPerMicro * microsPerIncrement;
+public:
+  Lock(CMusic& music);
+  ~Lock();
 
-  // convert timeout from ticks to microseconds,
-  // round up to next minimum increment,
-  // add one more minimum increment to handle aliasing
+private:
+  CMusic& _music;
+  bool _lockPrev;
+};
 
-  static unsigned long const microsDeltaTimeout =
-    (TICKS + ticksPerIncrement - 1) / ticksPerMicro + microsPerIncrement;
 
-  unsigned long microsStart = micros();
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CMusic::Lock (implementation)
+//
 
-  while (music._pinRequest == LOW && micros() - microsStart <= microsDeltaTimeout);
+inline CMusic::Lock::Lock(CMusic& music)
+  : _music    (music)
+  , _lockPrev (music._lock)
+{
+  _music._lock = true;
+  asm volatile ("" ::: "memory");
 }
 
 
-template<uint8_t ADDRESS, class TWriteUntil>
-inline uint16_t CMusic::Register::Binding<ADDRESS, TWriteUntil>::read(CMusic& music)
+inline CMusic::Lock::~Lock()
 {
-  music._pinSelectControl = LOW;
-
-  delayMicroseconds(1);
+  asm volatile ("" ::: "memory");
+  _music._lock = _lockPrev;
+}
 
-  SPI.transfer(SCI_OPCODE_READ);
-  SPI.transfer(ADDRESS);
 
-  uint16_t value =
-      (uint16_t) SPI.transfer(0xFF) << 8
-    | (uint16_t) SPI.transfer(0xFF) << 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CMusic::PluginProgmem
+//  CMusic::PluginFile
+//
+//  Sources of plugin words for loadPlugin(). fill() makes up to the given
+//  number of words available to next() and returns how many it did, which
+//  is zero at the end of the plugin. The file source reads ahead in chunks,
+//  which must not happen in the middle of an SCI transaction because the
+//  SD card shares the SPI bus.
+//
 
-  delayMicroseconds(1);
+class CMusic::PluginProgmem
+{
+public:
+  PluginProgmem(uint16_t const* words, size_t nWords);
 
-  music._pinSelectControl = HIGH;
+  size_t fill(size_t nWordsMax);
+  uint16_t next();
 
-  return value;
-}
+private:
+  uint16_t const* _words;
+  size_t _nWords;
+};
 
 
-template<uint8_t ADDRESS, class TWriteUntil>
-inline void CMusic::Register::Binding<ADDRESS, TWriteUntil>::write(CMusic& music, uint16_t value)
+class CMusic::PluginFile
 {
-  music._pinSelectControl = LOW;
-
-  delayMicroseconds(1);
-
-  SPI.transfer(SCI_OPCODE_WRITE);
-  SPI.transfer(ADDRESS);
-  SPI.transfer((uint8_t) (value >> 8) & 0xFF);
-  SPI.transfer((uint8_t) (value >> 0) & 0xFF);
+public:
+  PluginFile(File& file);
 
-  delayMicroseconds(1);
+  size_t fill(size_t nWordsMax);
+  uint16_t next();
 
-  TWriteUntil::wait(music);
+private:
+  File& _file;
 
-  music._pinSelectControl = HIGH;
-}
+  unsigned char _bytes[64];
+  uint8_t _nBytes;
+  uint8_t _iByte;
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  CMusic::Memory (implementation)
+//  CMusic::PluginProgmem (implementation)
+//  CMusic::PluginFile (implementation)
 //
 
-template<uint16_t ADDRESS>
-uint16_t CMusic::Memory::Binding<ADDRESS, uint16_t>::read(CMusic& music)
+inline CMusic::PluginProgmem::PluginProgmem(uint16_t const* words, size_t nWords)
+  : _words  (words)
+  , _nWords (nWords)
 {
-  music.write<Register::SCI_WRAMADDR>(ADDRESS);
-  return music.read<Register::SCI_WRAM>();
+  // nothing else to do
 }
 
 
-template<uint16_t ADDRESS>
-void CMusic::Memory::Binding<ADDRESS, uint16_t>::write(CMusic& music, uint16_t value)
+inline size_t CMusic::PluginProgmem::fill(size_t nWordsMax)
 {
-  music.write<Register::SCI_WRAMADDR>(ADDRESS);
-  music.write<Register::SCI_WRAM>(value);
+  return (_nWords < nWordsMax ? _nWords : nWordsMax);
 }
 
 
-template<uint16_t ADDRESS>
-uint32_t CMusic::Memory::Binding<ADDRESS, uint32_t>::read(CMusic& music)
+inline uint16_t CMusic::PluginProgmem::next()
 {
-  uint32_t valuePrev = 0xFFFFFFFF;
+  _nWords--;
+  return pgm_read_word(_words++);
+}
 
-  for (;;) {
-    music.write<Register::SCI_WRAMADDR>(ADDRESS);
 
-    uint32_t valueNext =
-        (uint32_t) music.read<Register::SCI_WRAM>() << 16
-      | (uint32_t) music.read<Register::SCI_WRAM>() <<  0;
+inline CMusic::PluginFile::PluginFile(File& file)
+  : _file   (file)
+  , _nBytes (0)
+  , _iByte  (0)
+{
+  // nothing else to do
+}
+
 
-    if (valuePrev == valueNext)
-      break;
-    
-    valuePrev = valueNext;
+inline size_t CMusic::PluginFile::fill(size_t nWordsMax)
+{
+  size_t nWords = (_nBytes - _iByte) / 2;
+
+  if (nWords < nWordsMax) {
+    // keep what's left (including an odd byte) and read on after it
+
+    uint8_t nBytesKept = _nBytes - _iByte;
+
+    memmove(_bytes, _bytes + _iByte, nBytesKept);
+
+    int nBytesRead = _file.read(_bytes + nBytesKept, sizeof(_bytes) - nBytesKept);
+
+    _nBytes = nBytesKept + (nBytesRead > 0 ? nBytesRead : 0);
+    _iByte  = 0;
+
+    nWords = _nBytes / 2;
   }
 
-  return valuePrev;
+  return (nWords < nWordsMax ? nWords : nWordsMax);
+}
+
+
+inline uint16_t CMusic::PluginFile::next()
+{
+  // little-endian, the same as the words in a plugin array on the Arduino
+
+  uint16_t value =
+      (uint16_t) _bytes[_iByte + 0] << 0
+    | (uint16_t) _bytes[_iByte + 1] << 8;
+
+  _iByte += 2;
+
+  return value;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  TReadable (implementation)
-//  TWritable (implementation)
+//  CMusic::TailFile
+//  CMusic::TailSectors
+//
+//  Where findEnd() reads the end of a file from: through the SD library,
+//  or straight from the card for a file that occupies a single contiguous
+//  range of blocks. read() returns whether it got all bytes asked for.
 //
 
-template<class TReadable>
-inline typename TReadable::Value CMusic::read()
+class CMusic::TailFile
 {
-  return TReadable::read(*this);
-}
+public:
+  TailFile(File& file);
 
+  bool read(uint32_t position, unsigned char* bytes, size_t nBytes);
 
-template<class TWritable>
-inline void CMusic::write(typename TWritable::Value value)
+private:
+  File& _file;
+};
+
+
+class CMusic::TailSectors
 {
-  TWritable::write(*this, value);
-}
+public:
+  TailSectors(Sd2Card& card, uint32_t blockFirst);
+
+  bool read(uint32_t position, unsigned char* bytes, size_t nBytes);
+
+private:
+  Sd2Card& _card;
+  uint32_t _blockFirst;
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  CMusic::Buffer (implementation)
+//  CMusic::TailFile (implementation)
+//  CMusic::TailSectors (implementation)
 //
 
-template<size_t SIZE>
-inline CMusic::Buffer<SIZE>::Buffer()
-  : _file   (0)
-  , _offset (0)
-  , _length (0)
+inline CMusic::TailFile::TailFile(File& file)
+  : _file (file)
 {
   // nothing else to do
 }
 
 
-template<size_t SIZE>
-inline void CMusic::Buffer<SIZE>::open(File& file)
+inline bool CMusic::TailFile::read(uint32_t position, unsigned char* bytes, size_t nBytes)
 {
-  _file = &file;
-
-  _offset = 0;
-  _length = _file->read(_buffer, SIZE);
+  return (_file.seek(position) && _file.read(bytes, nBytes) == (int) nBytes);
 }
 
 
-template<size_t SIZE>
-void CMusic::Buffer<SIZE>::refill(size_t nBytesMin)
+inline CMusic::TailSectors::TailSectors(Sd2Card& card, uint32_t blockFirst)
+  : _card       (card)
+  , _blockFirst (blockFirst)
 {
-  if (!active() || _length >= nBytesMin)
-    return;
-
-  if (_length > 0 && _offset > 0) {
-    unsigned char* byteDest   = _buffer;
-    unsigned char* byteSource = _buffer + _offset;
-
-    for (size_t iByte = 0; iByte < _length; ++iByte)
-      *byteDest++ = *byteSource++;
-  }
-
-  _offset = 0;
-  _length += _file->read(_buffer + _length, SIZE - _length);
+  // nothing else to do
 }
 
 
-template<size_t SIZE>
-inline void CMusic::Buffer<SIZE>::close()
+inline bool CMusic::TailSectors::read(uint32_t position, unsigned char* bytes, size_t nBytes)
 {
-  _file   = 0;
-  _offset = 0;
-  _length = 0;
-}
+  // at most two blocks, as what's asked for may straddle a block boundary
 
+  while (nBytes > 0) {
+    uint16_t offsetBlock = position % 512;
+    uint16_t nBytesBlock = 512 - offsetBlock;
 
-template<size_t SIZE>
-inline size_t CMusic::Buffer<SIZE>::available() const
-{
-  return _length;
-}
+    if (nBytesBlock > nBytes)
+      nBytesBlock = nBytes;
 
+    if (!_card.readData(_blockFirst + position / 512, offsetBlock, nBytesBlock, bytes))
+      return false;
 
-template<size_t SIZE>
-inline unsigned char CMusic::Buffer<SIZE>::read()
-{
-  if (_length == 0)
-    return 0;
+    position += nBytesBlock;
+    bytes    += nBytesBlock;
+    nBytes   -= nBytesBlock;
+  }
 
-  _length--;
-  return _buffer[_offset++];
+  return true;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  CMusic (implementation)
+//  CMusic::Register (implementation)
 //
 
-CMusic::CMusic()
-  : _cancel               (false)
-  , _actionCancel         (ACTION_CANCEL_NONE)
-  , _actionBuffer         (ACTION_BUFFER_NONE)
-  , _nBytesFlushRemaining (0)
-  , _volume               (255)
-  , _balance              (0)
-  , _msecPlaybackStart    (0)
+template<unsigned long TICKS>
+inline void CMusic::Register::WriteUntilPinOrTimeout<TICKS>::wait(CMusic& music)
 {
-  // nothing else to do
-}
+  static unsigned long const microsPerIncrement =  4;
+  static unsigned long const ticksPerMicro      = 12;
+  static unsigned long const ticksPerIncrement  = ticksPerMicro * microsPerIncrement;
 
+  // convert timeout from ticks to microseconds,
+  // round up to next minimum increment,
+  // add one more minimum increment to handle aliasing
 
-void CMusic::begin(uint8_t addressPinReset, uint8_t addressPinRequest, uint8_t addressPinSelectData, uint8_t addressPinSelectControl)
-{
-  _pinReset        .begin(addressPinReset,         HIGH);
-  _pinRequest      .begin(addressPinRequest);
-  _pinSelectData   .begin(addressPinSelectData,    HIGH);
-  _pinSelectControl.begin(addressPinSelectControl, HIGH);
+  static unsigned long const microsDeltaTimeout =
+    (TICKS + ticksPerIncrement - 1) / ticksPerMicro + microsPerIncrement;
 
-  reset();
+  unsigned long microsStart = micros();
+
+  while (music._pinRequest == LOW && micros() - microsStart <= microsDeltaTimeout);
 }
 
 
-void CMusic::reset(bool hardware, bool settings)
+inline bool CMusic::Register::ShadowNone::lookup(CMusic&, uint16_t&)
 {
-  if (hardware) {
-    // hardware reset
+  return false;
+}
 
-    _pinSelectControl = HIGH;
-    _pinSelectData    = HIGH;
 
-    _pinReset = LOW;   delay(10);
-    _pinReset = HIGH;  delay(10);
+inline bool CMusic::Register::ShadowNone::redundant(CMusic&, uint16_t)
+{
+  return false;
+}
 
-    while (_pinRequest == LOW);
 
+inline void CMusic::Register::ShadowNone::store(CMusic&, uint16_t)
+{
+  // nothing to do
+}
 
-    // set clock
 
-    uint16_t saveSPCR = SPCR;
-    uint16_t saveSPSR = SPSR;
+template<uint8_t SLOT, uint16_t BITS_VOLATILE>
+inline bool CMusic::Register::Shadow<SLOT, BITS_VOLATILE>::lookup(CMusic& music, uint16_t& value)
+{
+  if (!(music._shadowValid & (0x1 << SLOT)) || (music._shadow[SLOT] & BITS_VOLATILE))
+    return false;
 
-    SPI.setClockDivider(SPI_CLOCK_DIV64);
+  value = music._shadow[SLOT];
+  return true;
+}
 
-    write<Register::SCI_CLOCKF>(
-        0x4  << 13    // SC_MULT = 0b100  (set clock multiplier to 3.5)
-      | 0x3  << 11    // SC_ADD  = 0b11   (set clock modification by decoder allowed to max)
-      | 0x00 <<  0);  // SC_FREQ = 0      (indicate XTALI frequency is default 12.288 MHz)
 
-    SPCR = saveSPCR;
-    SPSR = saveSPSR;
-  }
+template<uint8_t SLOT, uint16_t BITS_VOLATILE>
+inline bool CMusic::Register::Shadow<SLOT, BITS_VOLATILE>::redundant(CMusic& music, uint16_t value)
+{
+  uint16_t valueShadow;
 
+  return (lookup(music, valueShadow) && valueShadow == value);
+}
 
-  // software reset
 
-  write<Register::SCI_MODE>(
-      Register::SM_SDINEW
-    | Register::SM_RESET);
+template<uint8_t SLOT, uint16_t BITS_VOLATILE>
+inline void CMusic::Register::Shadow<SLOT, BITS_VOLATILE>::store(CMusic& music, uint16_t value)
+{
+  static_assert(SLOT < sizeof(music._shadow) / sizeof(*music._shadow), "not enough register shadows");
 
-  while (_pinRequest == LOW);
+  music._shadow[SLOT] = value;
+  music._shadowValid |= (0x1 << SLOT);
+}
 
 
-  // enable I2S output
+inline void CMusic::Register::invalidate(CMusic& music)
+{
+  music._shadowValid = 0;
+}
 
-  write<Memory::GPIO_DDR>(
-      0x1 << 7    // set pin GPIO7 (I2S_SDATA) to output
-    | 0x1 << 6    // set pin GPIO6 (I2S_SCLK)  to output
-    | 0x1 << 5    // set pin GPIO5 (I2S_MCLK)  to output
-    | 0x1 << 4    // set pin GPIO4 (I2S_LROUT) to output
-    | 0x0 << 3    // set pin GPIO3 to input
-    | 0x0 << 2    // set pin GPIO2 to input
-    | 0x0 << 1    // set pin GPIO1 to input
-    | 0x0 << 0);  // set pin GPIO0 to input
 
-  write<Memory::I2S_CONFIG>(
-      0x1 << 3    // I2S_CF_MCLK_ENA = 0b1   (enable I2S_MCLK output)
-    | 0x1 << 2    // I2S_CF_ENA      = 0b1   (enable I2S)
-    | 0x0 << 0);  // I2S_CF_SRATE    = 0b00  (set I2S clock rate to 48 kHz)
+inline CMusic::Register::Burst::Burst(CMusic& music, uint8_t address)
+  : _music (music)
+{
+  SPI.beginTransaction(_music._spiControl);
 
+  _music._pinSelectControl = LOW;
 
-  // reset playback state
+  delayMicroseconds(1);
 
-  _buffer.close();
+  SPI.transfer(SCI_OPCODE_WRITE);
+  SPI.transfer(address);
+}
 
-  _cancel = false;
 
-  _actionCancel = ACTION_CANCEL_NONE;
-  _actionBuffer = ACTION_BUFFER_NONE;
+inline CMusic::Register::Burst::~Burst()
+{
+  delayMicroseconds(1);
 
-  _nBytesFlushRemaining = 0;
+  _music._pinSelectControl = HIGH;
 
-  if (settings) {
-    _volume  = 255;
-    _balance = 0;
-  }
-  else {
-    updateVolumeAndBalance();
-  }
+  SPI.endTransaction();
 }
 
 
-bool CMusic::play(File& file)
+inline void CMusic::Register::Burst::write(uint16_t value)
 {
-  if (state() != STATE_IDLE)
-    return false;
+  SPI.transfer((uint8_t) (value >> 8) & 0xFF);
+  SPI.transfer((uint8_t) (value >> 0) & 0xFF);
 
-  _buffer.open(file);
+  // the chip drops DREQ while it stores each word
 
-  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
-  _actionBuffer = ACTION_BUFFER_NONE;
+  WriteUntilPinOrTimeout<100>::wait(_music);
+}
 
-  _msecPlaybackStart = millis();
 
-  return true;
+inline CMusic::Register::ReadBurst::ReadBurst(CMusic& music, uint8_t address)
+  : _music   (music)
+  , _address (address)
+{
+  SPI.beginTransaction(_music._spiControl);
+}
+
+
+inline CMusic::Register::ReadBurst::~ReadBurst()
+{
+  SPI.endTransaction();
+}
+
+
+inline uint16_t CMusic::Register::ReadBurst::read()
+{
+  _music._pinSelectControl = LOW;
+
+  delayMicroseconds(1);
+
+  SPI.transfer(SCI_OPCODE_READ);
+  SPI.transfer(_address);
+
+  uint16_t value =
+      (uint16_t) SPI.transfer(0xFF) << 8
+    | (uint16_t) SPI.transfer(0xFF) << 0;
+
+  delayMicroseconds(1);
+
+  _music._pinSelectControl = HIGH;
+
+  return value;
+}
+
+
+template<uint8_t ADDRESS, class TWriteUntil, class TShadow>
+inline uint16_t CMusic::Register::Binding<ADDRESS, TWriteUntil, TShadow>::read(CMusic& music)
+{
+  uint16_t value;
+
+  if (TShadow::lookup(music, value))
+    return value;
+
+  SPI.beginTransaction(music._spiControl);
+
+  music._pinSelectControl = LOW;
+
+  delayMicroseconds(1);
+
+  SPI.transfer(SCI_OPCODE_READ);
+  SPI.transfer(ADDRESS);
+
+  value =
+      (uint16_t) SPI.transfer(0xFF) << 8
+    | (uint16_t) SPI.transfer(0xFF) << 0;
+
+  delayMicroseconds(1);
+
+  music._pinSelectControl = HIGH;
+
+  SPI.endTransaction();
+
+  TShadow::store(music, value);
+
+  return value;
+}
+
+
+template<uint8_t ADDRESS, class TWriteUntil, class TShadow>
+inline void CMusic::Register::Binding<ADDRESS, TWriteUntil, TShadow>::write(CMusic& music, uint16_t value)
+{
+  if (TShadow::redundant(music, value))
+    return;
+
+  SPI.beginTransaction(music._spiControl);
+
+  music._pinSelectControl = LOW;
+
+  delayMicroseconds(1);
+
+  SPI.transfer(SCI_OPCODE_WRITE);
+  SPI.transfer(ADDRESS);
+  SPI.transfer((uint8_t) (value >> 8) & 0xFF);
+  SPI.transfer((uint8_t) (value >> 0) & 0xFF);
+
+  delayMicroseconds(1);
+
+  TWriteUntil::wait(music);
+
+  music._pinSelectControl = HIGH;
+
+  SPI.endTransaction();
+
+  TShadow::store(music, value);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CMusic::Memory (implementation)
+//
+
+template<uint16_t ADDRESS>
+uint16_t CMusic::Memory::Binding<ADDRESS, uint16_t>::read(CMusic& music)
+{
+  music.write<Register::SCI_WRAMADDR>(ADDRESS);
+  return music.read<Register::SCI_WRAM>();
+}
+
+
+template<uint16_t ADDRESS>
+void CMusic::Memory::Binding<ADDRESS, uint16_t>::write(CMusic& music, uint16_t value)
+{
+  music.write<Register::SCI_WRAMADDR>(ADDRESS);
+  music.write<Register::SCI_WRAM>(value);
+}
+
+
+template<uint16_t ADDRESS>
+uint32_t CMusic::Memory::Binding<ADDRESS, uint32_t>::read(CMusic& music)
+{
+  // Least significant word first. The VS1053b may carry into the most
+  // significant word between the reads of the two, so read that once
+  // before and once after the least significant one, which is only ever
+  // worth another try if it changed in between.
+
+  for (;;) {
+    music.write<Register::SCI_WRAMADDR>(ADDRESS + 1);
+
+    uint16_t valueHighBefore = music.read<Register::SCI_WRAM>();
+
+    music.write<Register::SCI_WRAMADDR>(ADDRESS);
+
+    Register::ReadBurst burst(music, Register::SCI_WRAM::address);
+
+    uint16_t valueLow  = burst.read();
+    uint16_t valueHigh = burst.read();
+
+    if (valueHigh == valueHighBefore)
+      return (uint32_t) valueHigh << 16 | valueLow;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  TReadable (implementation)
+//  TWritable (implementation)
+//
+
+template<class TReadable>
+inline typename TReadable::Value CMusic::read()
+{
+  return TReadable::read(*this);
+}
+
+
+template<class TWritable>
+inline void CMusic::write(typename TWritable::Value value)
+{
+  TWritable::write(*this, value);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CMusic::Buffer (implementation)
+//
+
+template<size_t SIZE>
+inline CMusic::Buffer<SIZE>::Buffer()
+  : _source          (SOURCE_NONE)
+  , _eof             (false)
+  , _file            (0)
+  , _stream          (0)
+  , _card            (0)
+  , _blockFirst      (0)
+  , _positionFile    (0)
+  , _nBytesFile      (0)
+  , _endPending      (false)
+  , _block           (0)
+  , _offsetBlock     (0)
+  , _nBytesRemaining (0)
+  , _head            (0)
+  , _tail            (0)
+  , _nBytesPrevious  (0)
+  , _direct          (0)
+  , _nBytesDirect    (0)
+  , _directProgmem   (false)
+{
+  // nothing else to do
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::open(File& file)
+{
+  _source = SOURCE_FILE;
+  _eof    = false;
+
+  _file = &file;
+
+  _positionFile = 0;
+  _nBytesFile   = file.size();
+  _endPending   = false;
+
+  _head = 0;
+  _tail = 0;
+  _nBytesPrevious = 0;
+
+  _nBytesDirect = 0;
+
+  refill();
+  skipTag();
+
+  _endPending = true;
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::open(File& file, unsigned char const* direct, size_t nBytesDirect, bool progmem)
+{
+  // Hand out the given bytes (the start of the file, which is assumed to
+  // be positioned right after them) before anything from the ring buffer,
+  // straight from where they are. Don't refill yet, so that they can be
+  // sent before the first SD read.
+
+  _source = SOURCE_FILE;
+  _eof    = false;
+
+  _file = &file;
+
+  _positionFile = 0;
+  _nBytesFile   = file.size();
+  _endPending   = true;
+
+  _head = 0;
+  _tail = 0;
+  _nBytesPrevious = 0;
+
+  _direct        = direct;
+  _nBytesDirect  = nBytesDirect;
+  _directProgmem = progmem;
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::open(File& file, uint32_t position, uint32_t nBytes)
+{
+  // A range of the file, such as one clip out of a sound bank. Whoever
+  // packed it has already left out any tags, and seek() stays inside.
+
+  _source = SOURCE_FILE;
+  _eof    = false;
+
+  _file = &file;
+
+  _positionFile = position;
+  _nBytesFile   = position + nBytes;
+  _endPending   = false;
+
+  _head = 0;
+  _tail = 0;
+  _nBytesPrevious = 0;
+
+  _nBytesDirect = 0;
+
+  file.seek(position);
+
+  refill();
+}
+
+
+template<size_t SIZE>
+bool CMusic::Buffer<SIZE>::open(Sd2Card& card, SdFile& file)
+{
+  // Only files that occupy a single contiguous range of blocks on the card
+  // can be streamed sector by sector without walking the FAT cluster chain.
+  // Start wherever the file's read position currently is.
+
+  uint32_t blockFirst;
+  uint32_t blockLast;
+
+  if (!file.contiguousRange(&blockFirst, &blockLast))
+    return false;
+
+  uint32_t position = file.curPosition();
+  uint32_t size     = file.fileSize();
+
+  // Trailing tags are looked for right away: reading the last block or
+  // two straight from the card is cheap, and with no SD library in the
+  // way, there's no block boundary worth waiting for.
+
+  TailSectors tail(card, blockFirst);
+
+  size = CMusic::findEnd(tail, position, size);
+
+  _source = SOURCE_SECTORS;
+  _eof    = false;
+
+  _card            = &card;
+  _blockFirst      = blockFirst;
+  _positionFile    = 0;
+  _nBytesFile      = size;
+  _endPending      = false;
+  _block           = blockFirst + position / 512;
+  _offsetBlock     = position % 512;
+  _nBytesRemaining = (size > position ? size - position : 0);
+
+  // Keep the ring buffer aligned with the blocks on the card, so that whole
+  // blocks can be read straight into it once MUSIC_BUFFER_SIZE >= 512.
+
+  _head = _offsetBlock & (SIZE - 1);
+  _tail = _head;
+  _nBytesPrevious = 0;
+
+  _nBytesDirect = 0;
+
+  refill();
+  skipTag();
+
+  return true;
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::open(Stream& stream)
+{
+  // A stream has no end; it's read from for as long as it's open, and
+  // whatever it has available by then is taken.
+
+  _source = SOURCE_STREAM;
+  _eof    = false;
+
+  _stream = &stream;
+
+  _head = 0;
+  _tail = 0;
+  _nBytesPrevious = 0;
+
+  _nBytesDirect = 0;
+
+  refill();
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::open(unsigned char const* direct, size_t nBytesDirect, bool progmem)
+{
+  // all there is, handed out straight from where it is
+
+  _source = SOURCE_MEMORY;
+  _eof    = true;
+
+  _head = 0;
+  _tail = 0;
+  _nBytesPrevious = 0;
+
+  _direct        = direct;
+  _nBytesDirect  = nBytesDirect;
+  _directProgmem = progmem;
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::append(File& file)
+{
+  // keep whatever is left of the previous source in the buffer and
+  // carry on reading from the next one right after it
+
+  CMusic::skipTag(file);
+
+  _source = SOURCE_FILE;
+  _eof    = false;
+
+  _file = &file;
+
+  _positionFile = 0;
+  _nBytesFile   = file.size();
+  _endPending   = true;
+
+  _nBytesPrevious = available();
+
+  refill();
+}
+
+
+template<size_t SIZE>
+void CMusic::Buffer<SIZE>::findEnd()
+{
+  // Best done right at a block boundary, where the SD library has to read
+  // the next block anyway rather than read the current one once more.
+  // Refills only ever end on one if the file was lined up with the buffer
+  // to begin with, though, which an ID3v2 tag of any odd size undoes; the
+  // audio could be past the start of the trailing tags by the time the
+  // file runs out, so don't wait for a boundary then.
+
+  static size_t const nBytesAligned = (SIZE < 512 ? SIZE : 512);
+
+  if (!_endPending || _source != SOURCE_FILE)
+    return;
+
+  uint32_t position = _file->position();
+
+  if (position % 512 != 0 && (position - _head) % nBytesAligned == 0)
+    return;
+
+  _nBytesFile = CMusic::findEnd(*_file);
+  _endPending = false;
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::uses(File const& file) const
+{
+  return (_source == SOURCE_FILE && _file == &file);
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::seekable() const
+{
+  // not while the previous source's bytes are still ahead of the file's
+
+  return ((_source == SOURCE_FILE || _source == SOURCE_SECTORS) && _nBytesPrevious == 0);
+}
+
+
+template<size_t SIZE>
+int32_t CMusic::Buffer<SIZE>::seek(int32_t nBytesDelta)
+{
+  // Move the read position relative to the next byte to be sent (rather
+  // than the next one to be read from the card), drop whatever has been
+  // buffered, and read on from there. Returns how far it actually moved,
+  // which is less than asked for at either end of the file.
+
+  uint32_t position;
+  uint32_t size;
+
+  switch (_source) {
+    case SOURCE_FILE:     position = _file->position();               size = _nBytesFile;  break;
+    case SOURCE_SECTORS:  position = _nBytesFile - _nBytesRemaining;  size = _nBytesFile;  break;
+    default:              return 0;
+  }
+
+  position -= available();
+
+  if (nBytesDelta < 0 && (uint32_t) -nBytesDelta > position - _positionFile)
+    nBytesDelta = -(int32_t) (position - _positionFile);
+  if (nBytesDelta > 0 && (uint32_t) nBytesDelta > size - position)
+    nBytesDelta = size - position;
+
+  position += nBytesDelta;
+
+  if (_source == SOURCE_FILE) {
+    _file->seek(position);
+
+    _head = 0;
+  }
+  else {
+    _block           = _blockFirst + position / 512;
+    _offsetBlock     = position % 512;
+    _nBytesRemaining = size - position;
+
+    _head = _offsetBlock & (SIZE - 1);
+  }
+
+  _tail = _head;
+  _eof  = false;
+
+  _nBytesDirect = 0;
+
+  refill();
+
+  return nBytesDelta;
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::refillable() const
+{
+  // Wait until at least half of the buffer is free to keep SD reads large.
+
+  return (_source != SOURCE_NONE && !_eof && SIZE - (_head - _tail) >= SIZE / 2);
+}
+
+
+template<size_t SIZE>
+void CMusic::Buffer<SIZE>::refill()
+{
+  // _head and _tail run freely and are only wrapped into the buffer when
+  // indexing it, so that a full buffer can be told apart from an empty
+  // one without sacrificing a byte. Fill up to the end of the buffer and,
+  // if that wasn't enough, on from its start.
+
+  if (!refillable())
+    return;
+
+  for (uint8_t iSpan = 0; iSpan < 2; ++iSpan) {
+    size_t offsetHead = _head & (SIZE - 1);
+    size_t nBytesFree = SIZE - (_head - _tail);
+
+    if (nBytesFree > SIZE - offsetHead)
+      nBytesFree = SIZE - offsetHead;
+
+    if (nBytesFree == 0)
+      break;
+
+    size_t nBytesRead;
+
+    switch (_source) {
+      case SOURCE_FILE:     nBytesRead = readFile   (_buffer + offsetHead, nBytesFree);  break;
+      case SOURCE_SECTORS:  nBytesRead = readSectors(_buffer + offsetHead, nBytesFree);  break;
+      case SOURCE_STREAM:   nBytesRead = readStream (_buffer + offsetHead, nBytesFree);  break;
+      default:              nBytesRead = 0;                                               break;
+    }
+
+    _head += nBytesRead;
+
+    if (nBytesRead < nBytesFree)
+      break;
+  }
+}
+
+
+template<size_t SIZE>
+size_t CMusic::Buffer<SIZE>::readFile(unsigned char* bytes, size_t nBytesMax)
+{
+  // Finding trailing tags takes a couple of seeks and reads at the end of
+  // the file, which service() leaves until the VS1053b has a full buffer
+  // to play from. A short file may get to its end before that, which is
+  // when it's done at the latest.
+
+  uint32_t position = _file->position();
+
+  if (_endPending && nBytesMax >= _nBytesFile - position) {
+    _nBytesFile = CMusic::findEnd(*_file);
+    _endPending = false;
+  }
+
+  if (position >= _nBytesFile) {
+    _eof = true;
+    return 0;
+  }
+
+  if (nBytesMax > _nBytesFile - position)
+    nBytesMax = _nBytesFile - position;
+
+  int nBytesRead = _file->read(bytes, nBytesMax);
+
+  if (nBytesRead <= 0) {
+    _eof = true;
+    return 0;
+  }
+
+  return nBytesRead;
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::skipTag()
+{
+  // An ID3v2 tag in front of the audio is of no use to the decoder, and
+  // one with cover art in it takes longer to send than the first second
+  // of audio. Look at what the first refill got and read on behind it.
+
+  uint32_t nBytesTag = CMusic::tagSize(data(), contiguous());
+
+  if (nBytesTag != 0)
+    seek(nBytesTag);
+}
+
+
+template<size_t SIZE>
+size_t CMusic::Buffer<SIZE>::readSectors(unsigned char* bytes, size_t nBytesMax)
+{
+  size_t nBytesRead = 0;
+
+  while (nBytesRead < nBytesMax) {
+    if (_nBytesRemaining == 0) {
+      _eof = true;
+      break;
+    }
+
+    uint16_t nBytesBlock = 512 - _offsetBlock;
+
+    if (nBytesBlock > nBytesMax - nBytesRead)
+      nBytesBlock = nBytesMax - nBytesRead;
+    if (nBytesBlock > _nBytesRemaining)
+      nBytesBlock = _nBytesRemaining;
+
+    if (!_card->readData(_block, _offsetBlock, nBytesBlock, bytes + nBytesRead)) {
+      _eof = true;
+      break;
+    }
+
+    nBytesRead       += nBytesBlock;
+    _nBytesRemaining -= nBytesBlock;
+    _offsetBlock     += nBytesBlock;
+
+    if (_offsetBlock == 512) {
+      _offsetBlock = 0;
+      _block++;
+    }
+  }
+
+  return nBytesRead;
+}
+
+
+template<size_t SIZE>
+size_t CMusic::Buffer<SIZE>::readStream(unsigned char* bytes, size_t nBytesMax)
+{
+  // Stream has no bulk read that doesn't wait for more to arrive, so take
+  // what's there a byte at a time
+
+  int nBytesAvailable = _stream->available();
+
+  if (nBytesAvailable <= 0)
+    return 0;
+
+  size_t nBytesRead = (size_t) nBytesAvailable < nBytesMax ? nBytesAvailable : nBytesMax;
+
+  for (size_t iByte = 0; iByte < nBytesRead; ++iByte)
+    bytes[iByte] = _stream->read();
+
+  return nBytesRead;
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::close()
+{
+  _source = SOURCE_NONE;
+  _eof    = false;
+
+  _file   = 0;
+  _stream = 0;
+  _card   = 0;
+
+  _head = 0;
+  _tail = 0;
+  _nBytesPrevious = 0;
+
+  _nBytesDirect = 0;
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::eof() const
+{
+  return _eof;
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::exhausted() const
+{
+  return (_eof && available() == 0);
+}
+
+
+template<size_t SIZE>
+inline size_t CMusic::Buffer<SIZE>::available() const
+{
+  return _nBytesDirect + (_head - _tail);
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::direct() const
+{
+  return (_nBytesDirect > 0);
+}
+
+
+template<size_t SIZE>
+inline bool CMusic::Buffer<SIZE>::progmem() const
+{
+  return (_nBytesDirect > 0 && _directProgmem);
+}
+
+
+template<size_t SIZE>
+inline unsigned char const* CMusic::Buffer<SIZE>::data() const
+{
+  if (_nBytesDirect > 0)
+    return _direct;
+
+  return _buffer + (_tail & (SIZE - 1));
+}
+
+
+template<size_t SIZE>
+inline size_t CMusic::Buffer<SIZE>::contiguous() const
+{
+  if (_nBytesDirect > 0)
+    return _nBytesDirect;
+
+  size_t nBytesRing  = _head - _tail;
+  size_t nBytesToEnd = SIZE - (_tail & (SIZE - 1));
+
+  return (nBytesRing < nBytesToEnd ? nBytesRing : nBytesToEnd);
+}
+
+
+template<size_t SIZE>
+inline void CMusic::Buffer<SIZE>::skip(size_t nBytes)
+{
+  // never more than contiguous() at a time
+
+  if (_nBytesDirect > 0) {
+    if (nBytes > _nBytesDirect)
+      nBytes = _nBytesDirect;
+
+    _direct       += nBytes;
+    _nBytesDirect -= nBytes;
+  }
+  else {
+    if (nBytes > _head - _tail)
+      nBytes = _head - _tail;
+
+    _tail += nBytes;
+  }
+
+  _nBytesPrevious = (_nBytesPrevious > nBytes ? _nBytesPrevious - nBytes : 0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CMusic (implementation)
+//
+
+CMusic::CMusic()
+  : _instanceNext         (0)
+  , _shadowValid          (0)
+  , _spiControl           ()
+  , _spiData              ()
+  , _reset                (RESET_NONE)
+  , _msecReset            (0)
+  , _lock                 (false)
+  , _interrupt            (false)
+  , _format               (FORMAT_UNKNOWN)
+  , _queueHead            (0)
+  , _queueLength          (0)
+  , _clips                ()
+  , _record               ()
+  , _cancel               (false)
+  , _actionCancel         (ACTION_CANCEL_NONE)
+  , _actionBuffer         (ACTION_BUFFER_NONE)
+  , _nBytesFlushRemaining (0)
+  , _endFillByte          (0x00)
+  , _nBytesCancel         (0)
+  , _msecCancel           (0)
+  , _volume               (255)
+  , _balance              (0)
+  , _volumeFadeFrom       (0)
+  , _volumeFadeTo         (0)
+  , _msecFadeStart        (0)
+  , _msecFade             (0)
+  , _msecPosition         (0)
+  , _msecPositionUpdate   (0)
+  , _byteRate             (0)
+  , _spectrum             ()
+  , _overlay              ()
+  , _msecPowerDownAfter   (0)
+  , _msecIdle             (0)
+  , _idle                 (false)
+  , _poweredDown          (false)
+#if MUSIC_STATISTICS
+  , _statistics           ()
+  , _microsLoopPrev       (0)
+  , _underrun             (false)
+  , _microsCancel         (0)
+#endif
+{
+  // nothing else to do
+}
+
+
+void CMusic::begin(uint8_t addressPinReset, uint8_t addressPinRequest, uint8_t addressPinSelectData, uint8_t addressPinSelectControl)
+{
+  _pinReset        .begin(addressPinReset,         HIGH);
+  _pinRequest      .begin(addressPinRequest);
+  _pinSelectData   .begin(addressPinSelectData,    HIGH);
+  _pinSelectControl.begin(addressPinSelectControl, HIGH);
+
+  bool registered = false;
+
+  for (CMusic* music = _instances; music != 0; music = music->_instanceNext) {
+    if (music == this)
+      registered = true;
+  }
+
+  if (!registered) {
+    _instanceNext = _instances;
+    _instances = this;
+  }
+
+  reset();
+}
+
+
+void CMusic::reset(bool hardware, bool settings)
+{
+  // Only gets the reset going: loop() takes it from there a step at a
+  // time, whenever the VS1053b is ready for the next one, and state() is
+  // STATE_RESETTING until it's done (or STATE_ERROR if the VS1053b never
+  // comes back). That takes over 20 ms, which loop() isn't held up by.
+
+  Lock lock(*this);
+
+  // A software reset can't cut a hardware reset short, nor help a VS1053b
+  // that didn't come back from one.
+
+  if (_reset != RESET_NONE)
+    hardware = true;
+
+  Register::invalidate(*this);
+
+  _pinSelectControl = HIGH;
+  _pinSelectData    = HIGH;
+
+  if (hardware) {
+    // hardware reset, held for 10 ms
+
+    _pinReset = LOW;
+
+    _reset = RESET_HARDWARE;
+  }
+  else {
+    // a software reset leaves the clock as it is
+
+    wake();
+
+    write<Register::SCI_MODE>(
+        Register::SM_SDINEW
+      | Register::SM_RESET);
+
+    _reset = RESET_SOFTWARE;
+  }
+
+  _msecReset = millis();
+
+
+  // reset playback and recording state
+
+  _buffer.close();
+
+  _record.file = 0;
+  _record.stop = false;
+
+  _cancel = false;
+
+  _actionCancel = ACTION_CANCEL_NONE;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  _nBytesFlushRemaining = 0;
+  _nBytesCancel         = 0;
+
+  _msecFade = 0;
+
+  _idle = false;
+
+  // a software reset undoes any plugin
+
+  _spectrum.nBands = 0;
+
+  _overlay.mixer = false;
+  _overlay.file  = 0;
+  _overlay.nBytes = 0;
+
+  // back to their defaults, or else kept; loop() applies them once done
+
+  if (settings) {
+    _volume  = 255;
+    _balance = 0;
+  }
+}
+
+
+void CMusic::updateClock(uint16_t clockf)
+{
+  // CLKI is XTALI times SC_MULT (1.0, 2.0, 2.5, ... 5.0); SC_ADD only ever
+  // adds to that. SCI reads must be no faster than CLKI/7, SCI writes and
+  // SDI no faster than CLKI/4. SPISettings rounds down to what the host
+  // can do, at most F_CPU/2.
+
+  uint16_t freq = clockf & 0x7FF;
+  uint8_t  mult = clockf >> 13;
+
+  uint32_t hzXtali = (freq == 0 ? 12288000UL : 8000000UL + freq * 4000UL);
+  uint32_t hzClock = hzXtali / 2 * (mult == 0 ? 2 : mult + 3);
+
+  _spiControl = SPISettings(hzClock / 7, MSBFIRST, SPI_MODE0);
+  _spiData    = SPISettings(hzClock / 4, MSBFIRST, SPI_MODE0);
+}
+
+
+void CMusic::powerDown()
+{
+  // SCI_VOL at 0xFFFF powers down the analog side, and the bare XTALI
+  // clock is all that's left for the VS1053b to run on. Unlike SM_RESET
+  // or the RESET pin, neither needs the chip set up again afterwards.
+
+  write<Register::SCI_VOL>(0xFFFF);
+
+  write<Register::SCI_CLOCKF>(Register::CLOCKF_POWERDOWN);
+  updateClock(Register::CLOCKF_POWERDOWN);
+
+  _poweredDown = true;
+}
+
+
+void CMusic::wake()
+{
+  // Takes two SCI writes and the VS1053b settling on its new clock, which
+  // it signals with DREQ, rather than the 20 ms and more of reset().
+
+  _idle = false;
+
+  if (!_poweredDown)
+    return;
+
+  write<Register::SCI_CLOCKF>(Register::CLOCKF_PLAY);
+  updateClock(Register::CLOCKF_PLAY);
+
+  _poweredDown = false;
+
+  updateVolumeAndBalance();
+}
+
+
+bool CMusic::load(uint16_t const* plugin, size_t nWords)
+{
+  PluginProgmem source(plugin, nWords);
+  return loadPlugin(source);
+}
+
+
+bool CMusic::load(File& plugin)
+{
+  PluginFile source(plugin);
+  return loadPlugin(source);
+}
+
+
+bool CMusic::loadSpectrum(uint16_t const* plugin, size_t nWords)
+{
+  return (load(plugin, nWords) && beginSpectrum());
+}
+
+
+bool CMusic::loadSpectrum(File& plugin)
+{
+  return (load(plugin) && beginSpectrum());
+}
+
+
+bool CMusic::beginSpectrum()
+{
+  // The plugin sets up its bands as soon as it has started. Keep up to
+  // MUSIC_SPECTRUM_BANDS of them; any more are never read.
+
+  Lock lock(*this);
+
+  uint16_t nBands = read<Memory::spectrum_nBands>();
+
+  if (nBands == 0)
+    return false;
+
+  _spectrum.nBands     = (nBands < MUSIC_SPECTRUM_BANDS ? nBands : MUSIC_SPECTRUM_BANDS);
+  _spectrum.msecUpdate = millis() - MUSIC_SPECTRUM_INTERVAL;
+
+  for (uint8_t iBand = 0; iBand < _spectrum.nBands; ++iBand)
+    _spectrum.levels[iBand] = 0;
+
+  return true;
+}
+
+
+uint8_t CMusic::spectrum(uint8_t* levels, uint8_t nLevelsMax)
+{
+  // Only ever hands out what loop() has read, so this doesn't touch the
+  // SPI bus. Nothing is decoded while idle, which makes for silence.
+
+  uint8_t nLevels = (_spectrum.nBands < nLevelsMax ? _spectrum.nBands : nLevelsMax);
+
+  for (uint8_t iLevel = 0; iLevel < nLevels; ++iLevel)
+    levels[iLevel] = (state() != STATE_IDLE ? _spectrum.levels[iLevel] : 0);
+
+  return nLevels;
+}
+
+
+uint8_t CMusic::level()
+{
+  // the loudest band
+
+  uint8_t levelMax = 0;
+
+  if (state() == STATE_IDLE)
+    return 0;
+
+  for (uint8_t iBand = 0; iBand < _spectrum.nBands; ++iBand) {
+    if (_spectrum.levels[iBand] > levelMax)
+      levelMax = _spectrum.levels[iBand];
+  }
+
+  return levelMax;
+}
+
+
+void CMusic::updateSpectrum()
+{
+  // One write to SCI_WRAMADDR and then a read per band from SCI_WRAM,
+  // which auto-increments, all in a single SPI transaction - rather than
+  // setting the address for every band. Takes a fraction of a millisecond
+  // for all 14 of the plugin's default bands.
+
+  write<Register::SCI_WRAMADDR>(Memory::spectrum_bands);
+
+  Register::ReadBurst burst(*this, Register::SCI_WRAM::address);
+
+  for (uint8_t iBand = 0; iBand < _spectrum.nBands; ++iBand)
+    _spectrum.levels[iBand] = burst.read() & 0x3F;
+
+  _spectrum.msecUpdate = millis();
+}
+
+
+bool CMusic::loadMixer(uint16_t const* plugin, size_t nWords)
+{
+  return (load(plugin, nWords) && beginMixer());
+}
+
+
+bool CMusic::loadMixer(File& plugin)
+{
+  return (load(plugin) && beginMixer());
+}
+
+
+bool CMusic::beginMixer()
+{
+  // Once running, the plugin takes samples through SCI_AICTRL2 and mixes
+  // them into whatever the decoder plays, and tells how many more its
+  // FIFO has room for in SCI_AICTRL1 - which is never zero while empty.
+
+  Lock lock(*this);
+
+  _overlay.nWordsSize = read<Register::MIXER_FREE>();
+  _overlay.nWordsFree = 0;
+  _overlay.mixer      = (_overlay.nWordsSize != 0);
+
+  return _overlay.mixer;
+}
+
+
+bool CMusic::overlay(unsigned char const* samples, size_t nBytes)
+{
+  Lock lock(*this);
+
+  if (!_overlay.mixer || _record.file != 0)
+    return false;
+
+  wake();
+
+  // replaces whatever effect was still playing
+
+  _overlay.bytes   = samples;
+  _overlay.nBytes  = nBytes;
+  _overlay.progmem = false;
+  _overlay.file    = 0;
+
+  return true;
+}
+
+
+bool CMusic::overlay_P(unsigned char const* samples, size_t nBytes)
+{
+  Lock lock(*this);
+
+  if (!overlay(samples, nBytes))
+    return false;
+
+  _overlay.progmem = true;
+
+  return true;
+}
+
+
+bool CMusic::overlay(File& samples, unsigned char* buffer, size_t nBytesBuffer)
+{
+  Lock lock(*this);
+
+  // whole samples only, so that none is ever split across two reads
+
+  nBytesBuffer &= ~(size_t) 1;
+
+  if (nBytesBuffer == 0 || !overlay(0, 0))
+    return false;
+
+  samples.seek(0);
+
+  _overlay.file         = &samples;
+  _overlay.buffer       = buffer;
+  _overlay.nBytesBuffer = nBytesBuffer;
+
+  return true;
+}
+
+
+void CMusic::cancelOverlay()
+{
+  Lock lock(*this);
+
+  _overlay.nBytes = 0;
+  _overlay.file   = 0;
+}
+
+
+bool CMusic::serviceOverlay(bool& active)
+{
+  // One burst of up to 128 samples per round of loop(), ahead of the
+  // 32-byte chunk for SDI, for as long as the mixer has room. Its room is
+  // only read again once what was read last time has been used up; it
+  // only grows in the meantime. Returns whether there's more to send.
+  //
+  // Only while DREQ is high, though, unless the interrupt is enabled: the
+  // VS1053b drops it while storing each sample, which can't be told apart
+  // from a full SDI buffer, so each sample would wait for the write
+  // timeout instead. The SDI buffer only gets emptier while samples are
+  // sent, so DREQ stays high. The interrupt, however, keeps that buffer
+  // full for as long as it keeps up with the decoder, and the mixer would
+  // starve waiting for DREQ; the slower bursts are the lesser evil then.
+
+  if (!overlaying() || (_pinRequest == LOW && !_interrupt))
+    return false;
+
+  if (_overlay.nBytes < 2) {
+    // before the SCI transaction, as the SD card shares the bus
+
+    int nBytesRead = _overlay.file->read(_overlay.buffer, _overlay.nBytesBuffer);
+
+    if (nBytesRead < 2) {
+      cancelOverlay();
+      return false;
+    }
+
+    _overlay.bytes   = _overlay.buffer;
+    _overlay.nBytes  = nBytesRead;
+    _overlay.progmem = false;
+  }
+
+  if (_overlay.nWordsFree == 0) {
+    _overlay.nWordsFree = read<Register::MIXER_FREE>();
+
+    if (_overlay.nWordsFree == 0)
+      return false;
+  }
+
+  size_t nWords = _overlay.nBytes / 2;
+
+  if (nWords > _overlay.nWordsFree)
+    nWords = _overlay.nWordsFree;
+  if (nWords > 128)
+    nWords = 128;
+
+  {
+    Register::Burst burst(*this, Register::MIXER_DATA::address);
+
+    for (size_t iWord = 0; iWord < nWords; ++iWord) {
+      unsigned char const* bytes = _overlay.bytes + 2 * iWord;
+
+      // little-endian, as 16-bit PCM usually comes
+
+      uint16_t value = (_overlay.progmem
+        ? (uint16_t) pgm_read_byte(bytes + 0) << 0 | (uint16_t) pgm_read_byte(bytes + 1) << 8
+        : (uint16_t) bytes[0]                 << 0 | (uint16_t) bytes[1]                 << 8);
+
+      burst.write(value);
+    }
+  }
+
+  _overlay.bytes      += 2 * nWords;
+  _overlay.nBytes     -= 2 * nWords;
+  _overlay.nWordsFree -= nWords;
+
+  active = true;
+
+  if (_overlay.nBytes < 2 && _overlay.file == 0)
+    _overlay.nBytes = 0;
+
+  return overlaying();
+}
+
+
+template<class TPlugin>
+bool CMusic::loadPlugin(TPlugin& plugin)
+{
+  Lock lock(*this);
+
+  if (state() != STATE_IDLE)
+    return false;
+
+  // VLSI's compressed plugin format is a sequence of records, each made up
+  // of a register address and a word count, followed by that many words
+  // to write to the register, or - if the count's top bit is set - by a
+  // single word to write to it that many times.
+
+  bool success = true;
+
+  while (success) {
+    size_t nWordsRecord = plugin.fill(2);
+
+    if (nWordsRecord < 2) {
+      success = (nWordsRecord == 0);
+      break;
+    }
+
+    uint16_t address = plugin.next();
+    uint16_t nWords  = plugin.next();
+
+    if (address > 0xF) {
+      success = false;
+    }
+    else if (nWords & 0x8000) {
+      if (plugin.fill(1) != 1) {
+        success = false;
+        break;
+      }
+
+      uint16_t value = plugin.next();
+
+      Register::Burst burst(*this, address);
+
+      for (nWords &= 0x7FFF; nWords > 0; --nWords)
+        burst.write(value);
+    }
+    else {
+      while (nWords > 0) {
+        size_t nWordsBurst = plugin.fill(nWords);
+
+        if (nWordsBurst == 0) {
+          success = false;
+          break;
+        }
+
+        Register::Burst burst(*this, address);
+
+        for (nWords -= nWordsBurst; nWordsBurst > 0; --nWordsBurst)
+          burst.write(plugin.next());
+      }
+    }
+  }
+
+  // plugins may well write to registers that are otherwise host-owned
+
+  Register::invalidate(*this);
+
+  return success;
+}
+
+
+bool CMusic::play(File& file)
+{
+  Lock lock(*this);
+
+  if (state() != STATE_IDLE)
+    return false;
+
+  wake();
+
+  _buffer.open(file);
+
+  _format = format(_buffer.data(), _buffer.contiguous());
+
+  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  clearPosition();
+
+  return true;
+}
+
+
+bool CMusic::clip(uint8_t index, File& file, unsigned char* buffer, size_t nBytesBuffer)
+{
+  Lock lock(*this);
+
+  if (index >= MUSIC_CLIP_COUNT || inUse(file))
+    return false;
+
+  file.seek(0);
+  skipTag(file);
+
+  int nBytesRead = file.read(buffer, nBytesBuffer);
+
+  if (nBytesRead <= 0)
+    return false;
+
+  Clip& clip = _clips[index];
+
+  clip.file         = &file;
+  clip.head         = buffer;
+  clip.nBytesHead   = nBytesRead;
+  clip.positionBody = file.position();
+  clip.progmem      = false;
+  clip.format       = format(buffer, nBytesRead);
+
+  return true;
+}
+
+
+bool CMusic::clip_P(uint8_t index, File& file, unsigned char const* head, size_t nBytesHead)
+{
+  Lock lock(*this);
+
+  if (index >= MUSIC_CLIP_COUNT || nBytesHead == 0 || inUse(file))
+    return false;
+
+  unsigned char bytes[3];
+  size_t nBytes = (nBytesHead < sizeof(bytes) ? nBytesHead : sizeof(bytes));
+
+  memcpy_P(bytes, head, nBytes);
+
+  // the head is a copy of the audio itself, from behind any ID3v2 tag
+
+  file.seek(0);
+  skipTag(file);
+
+  Clip& clip = _clips[index];
+
+  clip.file         = &file;
+  clip.head         = head;
+  clip.nBytesHead   = nBytesHead;
+  clip.positionBody = file.position() + nBytesHead;
+  clip.progmem      = true;
+  clip.format       = format(bytes, nBytes);
+
+  return true;
+}
+
+
+bool CMusic::playClip(uint8_t index)
+{
+  Lock lock(*this);
+
+  if (state() != STATE_IDLE || index >= MUSIC_CLIP_COUNT || _clips[index].file == 0)
+    return false;
+
+  wake();
+
+  Clip const& clip = _clips[index];
+
+  clip.file->seek(clip.positionBody);
+
+  _buffer.open(*clip.file, clip.head, clip.nBytesHead, clip.progmem);
+
+  _format = clip.format;
+
+  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  // Send as much of the head as the VS1053b will take right away, so that
+  // it starts decoding before the first read from the SD card, which is
+  // left to loop().
+
+  while (_buffer.direct() && _pinRequest == HIGH)
+    sendAudio(32);
+
+  clearPosition();
+
+  return true;
+}
+
+
+bool CMusic::playBank(File& bank, uint16_t index)
+{
+  Lock lock(*this);
+
+  uint32_t position;
+  uint32_t nBytes;
+
+  if (state() != STATE_IDLE || !lookupBank(bank, index, position, nBytes))
+    return false;
+
+  wake();
+
+  _buffer.open(bank, position, nBytes);
+
+  _format = format(_buffer.data(), _buffer.contiguous());
+
+  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  clearPosition();
+
+  return true;
+}
+
+
+bool CMusic::play(Sd2Card& card, SdFile& file)
+{
+  Lock lock(*this);
+
+  if (state() != STATE_IDLE)
+    return false;
+
+  wake();
+
+  if (!_buffer.open(card, file))
+    return false;
+
+  _format = FORMAT_UNKNOWN;
+
+  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  clearPosition();
+
+  return true;
+}
+
+
+bool CMusic::record(File& file, unsigned char* buffer, size_t nBytesBuffer, uint16_t sampleRate, bool line)
+{
+  Lock lock(*this);
+
+  // The file is expected to be empty. Whole blocks of the buffer are
+  // written to the SD card at block-aligned positions in the file, which
+  // the SD library does without going through its own block cache; with
+  // two blocks or more, the VS1053b can be read into one while another
+  // is still waiting to be written.
+
+  if (state() != STATE_IDLE
+      || nBytesBuffer < 512
+      || nBytesBuffer % 512 != 0
+      || sampleRate < 8000
+      || sampleRate > 48000)
+    return false;
+
+  wake();
+
+  _record.file          = &file;
+  _record.buffer        = buffer;
+  _record.nBytesBuffer  = nBytesBuffer;
+  _record.sampleRate    = sampleRate;
+  _record.nBytesRead    = 60;
+  _record.nBytesWritten = 0;
+  _record.nWordsStop    = 0;
+  _record.stop          = false;
+
+  // the header is completed with the actual length when recording stops
+
+  headerRecord(buffer, sampleRate, 0);
+
+  // IMA ADPCM from the left channel (microphone or line in) only, with
+  // automatic gain control; a software reset starts the encoder
+
+  write<Register::SCI_AICTRL0>(sampleRate);
+  write<Register::SCI_AICTRL1>(0);  // automatic gain control
+  write<Register::SCI_AICTRL2>(0);  // up to 64x
+  write<Register::SCI_AICTRL3>(2);  // left channel, IMA ADPCM
+
+  write<Register::SCI_MODE>(
+      Register::SM_SDINEW
+    | Register::SM_ADPCM
+    | Register::SM_RESET
+    | (line ? Register::SM_LINE1 : 0));
+
+  // loop() waits for DREQ before reading anything
+
+  _reset     = RESET_RECORD;
+  _msecReset = millis();
+
+  return true;
+}
+
+
+bool CMusic::play(Stream& stream)
+{
+  Lock lock(*this);
+
+  if (state() != STATE_IDLE)
+    return false;
+
+  wake();
+
+  _buffer.open(stream);
+
+  _format = format(_buffer.data(), _buffer.contiguous());
+
+  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  clearPosition();
+
+  return true;
+}
+
+
+bool CMusic::play(unsigned char const* bytes, size_t nBytes)
+{
+  return playMemory(bytes, nBytes, false);
+}
+
+
+bool CMusic::play_P(unsigned char const* bytes, size_t nBytes)
+{
+  return playMemory(bytes, nBytes, true);
+}
+
+
+bool CMusic::playMemory(unsigned char const* bytes, size_t nBytes, bool progmem)
+{
+  Lock lock(*this);
+
+  if (state() != STATE_IDLE || nBytes == 0)
+    return false;
+
+  wake();
+
+  unsigned char head[3];
+  size_t nBytesHead = (nBytes < sizeof(head) ? nBytes : sizeof(head));
+
+  if (progmem)
+         memcpy_P(head, bytes, nBytesHead);
+    else memcpy  (head, bytes, nBytesHead);
+
+  _buffer.open(bytes, nBytes, progmem);
+
+  _format = format(head, nBytesHead);
+
+  _actionCancel = ACTION_CANCEL_SET_AFTER_FLUSH;
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  // like playClip(), but there's no SD card to wait for at all
+
+  while (_buffer.direct() && _pinRequest == HIGH)
+    sendAudio(32);
+
+  clearPosition();
+
+  return true;
+}
+
+
+bool CMusic::queue(File& file)
+{
+  Lock lock(*this);
+
+  if (_queueLength == MUSIC_QUEUE_SIZE)
+    return false;
+
+  uint8_t iQueue = (_queueHead + _queueLength) % MUSIC_QUEUE_SIZE;
+
+  _queue      [iQueue] = &file;
+  _queueFormat[iQueue] = format(file);
+
+  _queueLength++;
+
+  if (state() == STATE_IDLE
+      && _actionCancel == ACTION_CANCEL_NONE
+      && _actionBuffer == ACTION_BUFFER_NONE)
+    playNext();
+
+  return true;
+}
+
+
+bool CMusic::playNext()
+{
+  if (_queueLength == 0)
+    return false;
+
+  File& file = *_queue[_queueHead];
+
+  _queueHead = (_queueHead + 1) % MUSIC_QUEUE_SIZE;
+  _queueLength--;
+
+  return play(file);
+}
+
+
+bool CMusic::inUse(File const& file) const
+{
+  // Whether the file is being played, queued, overlaid or recorded into,
+  // and so mustn't be moved away from where that left it.
+
+  if (_buffer.uses(file) || _overlay.file == &file || _record.file == &file)
+    return true;
+
+  for (uint8_t iQueue = 0; iQueue < _queueLength; ++iQueue) {
+    if (_queue[(_queueHead + iQueue) % MUSIC_QUEUE_SIZE] == &file)
+      return true;
+  }
+
+  return false;
+}
+
+
+bool CMusic::appendNext()
+{
+  // Streams of the same frame-based format can simply follow each other:
+  // the decoder syncs to the next frame header and plays on without a gap.
+  // Anything else needs the full end-of-file flush before the next file
+  // can start, which loop() takes care of.
+
+  if (_queueLength == 0
+      || _format == FORMAT_UNKNOWN
+      || _format != _queueFormat[_queueHead])
+    return false;
+
+  File& file = *_queue[_queueHead];
+
+  _queueHead = (_queueHead + 1) % MUSIC_QUEUE_SIZE;
+  _queueLength--;
+
+  _buffer.append(file);
+
+  // The VS1053b won't get to the next file until it has played whatever
+  // is left of this one, but it won't tell when that is, either.
+
+  clearPosition();
+
+  return true;
 }
 
 
 bool CMusic::cancel()
 {
-  if (state() != STATE_PLAYING)
+  Lock lock(*this);
+
+  if (state() == STATE_RECORDING) {
+    // everything the VS1053b has encoded so far still goes to the file,
+    // which is nothing unless it's done with its software reset
+
+    _record.nWordsStop = (_reset == RESET_NONE ? read<Register::SCI_HDAT1>() : 0);
+    _record.stop = true;
+
+    return true;
+  }
+
+  if (state() != STATE_PLAYING)
+    return false;
+
+  _queueLength = 0;
+
+  _actionCancel = ACTION_CANCEL_SET_IMMEDIATE;
+  _actionBuffer = ACTION_BUFFER_CLOSE_AFTER_CANCEL;
+
+#if MUSIC_STATISTICS
+  _microsCancel = micros();
+#endif
+
+  return true;
+}
+
+
+bool CMusic::seek(long msecDelta)
+{
+  Lock lock(*this);
+
+  // The VS1053b resyncs to the next frame header all by itself when its
+  // data stream jumps, so there's no need to cancel and flush. Setting
+  // resync lets WMA and AAC streams do the same; whatever audio from the
+  // old position is still in the chip's buffer is simply played out.
+
+  if (state() != STATE_PLAYING
+      || _actionCancel == ACTION_CANCEL_SET_IMMEDIATE
+      || _actionBuffer != ACTION_BUFFER_NONE
+      || _buffer.eof()
+      || !_buffer.seekable())
+    return false;
+
+  uint16_t byteRate = read<Memory::parametric_byteRate>();
+
+  if (byteRate == 0)
+    return false;
+
+  write<Memory::parametric_resync>(32767);
+
+  // split up to keep the intermediate products within 32 bits
+
+  int32_t nBytesDelta =
+      (int32_t) (msecDelta / 1000) * byteRate
+    + (int32_t) (msecDelta % 1000) * byteRate / 1000;
+
+  nBytesDelta = _buffer.seek(nBytesDelta);
+
+  int32_t msecJumped =
+      (nBytesDelta / byteRate) * 1000
+    + (nBytesDelta % byteRate) * 1000 / byteRate;
+
+  unsigned long msecPosition = position();
+
+  clearPosition(msecJumped < 0 && (unsigned long) -msecJumped > msecPosition ? 0 : msecPosition + msecJumped);
+
+  return true;
+}
+
+
+bool CMusic::loop(unsigned long msecMax)
+{
+  Lock lock(*this);
+
+  bool active = false;
+
+  unsigned long msecStart = (msecMax != 0 ? millis() : 0);
+
+  countLoop();
+  updateFade();
+
+  for (;;) {
+    if (msecMax != 0 && millis() - msecStart > msecMax)
+      return active;
+
+    if (!service(active))
+      return active;
+  }
+}
+
+
+bool CMusic::loopAll(unsigned long msecMax)
+{
+  // Serve all instances in turn, one round of service() each, for as long
+  // as any of them has more to do. That way, each VS1053b on the bus gets
+  // its data (and each its share of SD reads) a chunk at a time, instead
+  // of the last one waiting until all others are filled up. Start with a
+  // different instance every round, so that none is always served first.
+
+  bool active = false;
+
+  unsigned long msecStart = (msecMax != 0 ? millis() : 0);
+
+  for (CMusic* music = _instances; music != 0; music = music->_instanceNext) {
+    Lock lock(*music);
+    music->countLoop();
+    music->updateFade();
+  }
+
+  if (_instanceFirst == 0)
+    _instanceFirst = _instances;
+
+  for (;;) {
+    if (msecMax != 0 && millis() - msecStart > msecMax)
+      return active;
+
+    if (_instanceFirst == 0)
+      return active;
+
+    bool more = false;
+
+    CMusic* music = _instanceFirst;
+
+    do {
+      {
+        Lock lock(*music);
+
+        if (music->service(active))
+          more = true;
+      }
+
+      music = (music->_instanceNext != 0 ? music->_instanceNext : _instances);
+    }
+    while (music != _instanceFirst);
+
+    _instanceFirst = (_instanceFirst->_instanceNext != 0 ? _instanceFirst->_instanceNext : _instances);
+
+    if (!more)
+      return active;
+  }
+}
+
+
+unsigned long CMusic::deadline()
+{
+  // How many milliseconds loop() can be left alone before the VS1053b
+  // runs out of audio (or out of room for what it records), short of
+  // MUSIC_DEADLINE_MARGIN. Counts what's in the VS1053b's 2048-byte
+  // buffer, which is nearly full while DREQ is low, and what's in ours.
+  // Zero if loop() has something to do right away, or if the VS1053b
+  // hasn't worked out the bit rate yet. While a sound effect plays, the
+  // mixer's FIFO counts, too, and usually runs dry first. Returns
+  // ULONG_MAX when idle, or when the VS1053b didn't come back from a
+  // reset.
+
+  Lock lock(*this);
+
+  if (_reset == RESET_ERROR)
+    return ULONG_MAX;
+
+  if (_reset != RESET_NONE)
+    return 0;
+
+  unsigned long msecBuffered;
+
+  if (_record.file != 0) {
+    // mono IMA ADPCM, 128 words for every 505 samples, into a 1024-word
+    // buffer with SCI_HDAT1 words in it
+
+    if (_record.stop)
+      return 0;
+
+    uint16_t nWords = read<Register::SCI_HDAT1>();
+    uint32_t wordRate = (uint32_t) _record.sampleRate * 128 / 505;
+
+    msecBuffered = (nWords < 1024 ? (uint32_t) (1024 - nWords) * 1000 / wordRate : 0);
+  }
+  else if (state() == STATE_IDLE
+           && _queueLength == 0
+           && _actionCancel == ACTION_CANCEL_NONE
+           && _actionBuffer == ACTION_BUFFER_NONE) {
+    if (!overlaying())
+      return ULONG_MAX;
+
+    msecBuffered = ULONG_MAX;
+  }
+  else {
+    if (_cancel
+        || _actionCancel == ACTION_CANCEL_SET_IMMEDIATE
+        || _nBytesFlushRemaining > 0
+        || _byteRate == 0
+        || _pinRequest == HIGH)
+      return 0;
+
+    uint32_t nBytesBuffered = (2048 - 32) + _buffer.available();
+
+    msecBuffered = nBytesBuffered * 1000 / _byteRate;
+
+    // a fade wants to take its next step in time, too
+
+    if (_msecFade != 0) {
+      uint8_t nSteps = (_volumeFadeTo > _volumeFadeFrom ? _volumeFadeTo - _volumeFadeFrom : _volumeFadeFrom - _volumeFadeTo);
+      unsigned long msecStep = _msecFade / (nSteps != 0 ? nSteps : 1);
+
+      if (msecBuffered > msecStep + MUSIC_DEADLINE_MARGIN)
+        msecBuffered = msecStep + MUSIC_DEADLINE_MARGIN;
+    }
+  }
+
+  if (overlaying()) {
+    // what's left in the mixer's FIFO
+
+    uint16_t nWordsFree = read<Register::MIXER_FREE>();
+    uint16_t nWordsBuffered = (_overlay.nWordsSize > nWordsFree ? _overlay.nWordsSize - nWordsFree : 0);
+
+    unsigned long msecMixer = (uint32_t) nWordsBuffered * 1000 / MUSIC_MIXER_RATE;
+
+    if (msecBuffered > msecMixer)
+      msecBuffered = msecMixer;
+  }
+
+  return (msecBuffered > MUSIC_DEADLINE_MARGIN ? msecBuffered - MUSIC_DEADLINE_MARGIN : 0);
+}
+
+
+unsigned long CMusic::deadlineAll()
+{
+  // the earliest of all instances' deadlines
+
+  unsigned long msecDeadline = ULONG_MAX;
+
+  for (CMusic* music = _instances; music != 0; music = music->_instanceNext) {
+    unsigned long msecDeadlineInstance = music->deadline();
+
+    if (msecDeadlineInstance < msecDeadline)
+      msecDeadline = msecDeadlineInstance;
+  }
+
+  return msecDeadline;
+}
+
+
+inline void CMusic::countLoop()
+{
+#if MUSIC_STATISTICS
+  if (state() == STATE_PLAYING) {
+    unsigned long microsLoop = micros();
+
+    if (_microsLoopPrev != 0 && microsLoop - _microsLoopPrev > _statistics.microsLoopGapMax)
+      _statistics.microsLoopGapMax = microsLoop - _microsLoopPrev;
+
+    _microsLoopPrev = microsLoop;
+
+    if (_pinRequest == LOW)
+           ++_statistics.nLoopsRequestLow;
+      else ++_statistics.nLoopsRequestHigh;
+  }
+  else {
+    _microsLoopPrev = 0;
+  }
+#endif
+}
+
+
+bool CMusic::service(bool& active)
+{
+  // One round of loop(): at most one 32-byte chunk for the VS1053b and one
+  // read from the SD card. Returns false if there's nothing more to do for
+  // now, and sets active if anything was done at all.
+
+  if (_reset != RESET_NONE)
+    return serviceReset(active);
+
+  if (_record.file != 0)
+    return serviceRecord(active);
+
+  // a sound effect for the mixer, if any, gets its share of every round
+
+  bool more = serviceOverlay(active);
+
+  if (state() == STATE_IDLE
+      && _actionCancel == ACTION_CANCEL_NONE
+      && _actionBuffer == ACTION_BUFFER_NONE
+      && !playNext()) {
+    if (overlaying()) {
+      _idle = false;
+      return more;
+    }
+
+    if (!_idle) {
+      _idle = true;
+      _msecIdle = millis();
+    }
+    else if (!_poweredDown && _msecPowerDownAfter != 0 && millis() - _msecIdle >= _msecPowerDownAfter) {
+      powerDown();
+    }
+
+    return false;
+  }
+
+  _idle = false;
+
+  // The VS1053b clears SM_CANCEL once it has stopped decoding, which the
+  // datasheet says to check after every 32 bytes sent in the meantime. If
+  // that takes more than 2048 bytes (or a second), it isn't going to
+  // happen, and only a software reset helps.
+
+  if (_cancel) {
+    active = true;
+
+    if (millis() - _msecCancel > 1000) {
+      abortCancel();
+      return true;
+    }
+  }
+  else if (_actionCancel == ACTION_CANCEL_SET_IMMEDIATE) {
+    uint16_t mode = read<Register::SCI_MODE>();
+
+    if (!(mode & Register::SM_CANCEL))
+      write<Register::SCI_MODE>(mode | Register::SM_CANCEL);
+
+    _endFillByte = read<Memory::parametric_endFillByte>();
+
+    if (_actionBuffer == ACTION_BUFFER_CLOSE_AFTER_CANCEL)
+      _buffer.close();
+
+    _cancel = true;
+    _actionCancel = ACTION_CANCEL_NONE;
+
+    _nBytesCancel = 0;
+    _msecCancel   = millis();
+
+    active = true;
+  }
+
+  if (_cancel) {
+    // While cancelling, the VS1053b drops data much faster than it plays
+    // it, and at full SDI speed the end fill bytes easily catch up. DREQ
+    // comes back within a fraction of a millisecond then, which is better
+    // waited for than a whole loop() later.
+
+    unsigned long microsStart = micros();
+
+    while (_pinRequest == LOW && micros() - microsStart < 1000);
+  }
+
+  if (_pinRequest == LOW) {
+    // make use of the spare time while the VS1053b is busy
+
+    if (state() == STATE_PLAYING) {
+      if (millis() - _msecPositionUpdate >= MUSIC_POSITION_INTERVAL) {
+        updatePosition();
+        updateByteRate();
+      }
+      else if (_byteRate == 0) {
+        updateByteRate();
+      }
+
+      // The readout takes long enough for DREQ to come back, so have
+      // another round top up the FIFO before loop() hands back.
+
+      if (_spectrum.nBands != 0 && millis() - _spectrum.msecUpdate >= MUSIC_SPECTRUM_INTERVAL) {
+        updateSpectrum();
+        return true;
+      }
+    }
+
+    _buffer.findEnd();
+
+    return more;
+  }
+
+  active = true;
+
+  bool starved = false;
+
+  if (_cancel) {
+    // The VS1053b drops whatever it gets while cancelling, and end fill
+    // bytes are harmless if some of them arrive after it's done, unlike
+    // the middle of a file.
+
+    sendFlush(32);
+
+    _nBytesCancel += 32;
+
+    uint16_t mode = read<Register::SCI_MODE>();
+
+    if (!(mode & Register::SM_CANCEL)) {
+      _cancel = false;
+      finishCancel();
+    }
+    else if (_nBytesCancel >= 2048) {
+      abortCancel();
+      return true;
+    }
+  }
+  else {
+    size_t nBytesAudioSent = 0;
+    size_t nBytesFlushSent = 0;
+
+    if (_buffer.active()) {
+      nBytesAudioSent = sendAudio(32);
+
+      if (nBytesAudioSent < 32 && _buffer.exhausted()) {
+        // at the end of the file, the VS1053b needs enough of its end
+        // fill byte to get every last bit of audio out of its buffer
+        // before it can be told to cancel
+
+        _endFillByte = read<Memory::parametric_endFillByte>();
+        _nBytesFlushRemaining = 2052;
+        _buffer.close();
+      }
+    }
+
+    if (_nBytesFlushRemaining > 0) {
+      nBytesFlushSent = sendFlush(32 - nBytesAudioSent);
+
+      if (_nBytesFlushRemaining > nBytesFlushSent) {
+        _nBytesFlushRemaining -= nBytesFlushSent;
+      }
+      else {
+        _nBytesFlushRemaining = 0;
+        if (_actionCancel == ACTION_CANCEL_SET_AFTER_FLUSH)
+          _actionCancel = ACTION_CANCEL_SET_IMMEDIATE;
+      }
+    }
+
+    starved = (nBytesAudioSent == 0 && nBytesFlushSent == 0);
+  }
+
+  refill();
+
+  // A stream may have nothing for the VS1053b for a while, even though
+  // it's asking for more; that's for the next loop() to find out.
+
+  if (starved && _buffer.available() == 0 && !_buffer.eof())
+    return more;
+
+  if (_buffer.eof() && !_cancel && _actionBuffer == ACTION_BUFFER_NONE)
+    appendNext();
+
+  return true;
+}
+
+
+bool CMusic::serviceReset(bool& active)
+{
+  // The next step of reset() or record(), once the VS1053b is ready for
+  // it. The 10 ms that the RESET pin is held low (and then given to come
+  // back up) pass between loop() calls, and so does waiting for DREQ. If
+  // it doesn't come back within MUSIC_RESET_TIMEOUT of a step, it isn't
+  // going to. Returns true once done, so that loop() goes on right away.
+
+  unsigned long msecWaited = millis() - _msecReset;
+
+  switch (_reset) {
+    case RESET_HARDWARE:
+      if (msecWaited < 10)
+        return false;
+
+      _pinReset = HIGH;
+
+      _reset     = RESET_CLOCK;
+      _msecReset = millis();
+
+      active = true;
+      return false;
+
+    case RESET_CLOCK:
+      if (msecWaited < 10 || _pinRequest == LOW)
+        break;
+
+      // set clock, at SPI speeds that suit the bare XTALI clock until it's done
+
+      updateClock(Register::CLOCKF_POWERDOWN);
+      write<Register::SCI_CLOCKF>(Register::CLOCKF_PLAY);
+      updateClock(Register::CLOCKF_PLAY);
+
+      _poweredDown = false;
+
+      // software reset
+
+      write<Register::SCI_MODE>(
+          Register::SM_SDINEW
+        | Register::SM_RESET);
+
+      _reset     = RESET_SOFTWARE;
+      _msecReset = millis();
+
+      active = true;
+      return false;
+
+    case RESET_SOFTWARE:
+    case RESET_RECORD:
+      if (_pinRequest == LOW)
+        break;
+
+      Register::invalidate(*this);
+
+      if (_reset == RESET_SOFTWARE) {
+        // enable I2S output
+
+        write<Memory::GPIO_DDR>(
+            0x1 << 7    // set pin GPIO7 (I2S_SDATA) to output
+          | 0x1 << 6    // set pin GPIO6 (I2S_SCLK)  to output
+          | 0x1 << 5    // set pin GPIO5 (I2S_MCLK)  to output
+          | 0x1 << 4    // set pin GPIO4 (I2S_LROUT) to output
+          | 0x0 << 3    // set pin GPIO3 to input
+          | 0x0 << 2    // set pin GPIO2 to input
+          | 0x0 << 1    // set pin GPIO1 to input
+          | 0x0 << 0);  // set pin GPIO0 to input
+
+        write<Memory::I2S_CONFIG>(
+            0x1 << 3    // I2S_CF_MCLK_ENA = 0b1   (enable I2S_MCLK output)
+          | 0x1 << 2    // I2S_CF_ENA      = 0b1   (enable I2S)
+          | 0x0 << 0);  // I2S_CF_SRATE    = 0b00  (set I2S clock rate to 48 kHz)
+      }
+
+      _reset = RESET_NONE;
+
+      // whatever volume and balance were set in the meantime
+
+      updateVolumeAndBalance();
+
+      active = true;
+      return true;
+
+    default:
+      return false;
+  }
+
+  if (msecWaited >= MUSIC_RESET_TIMEOUT)
+    _reset = RESET_ERROR;
+
+  return false;
+}
+
+
+void CMusic::abortCancel()
+{
+  // extremely rare, according to the datasheet
+
+  reset(false, false);
+
+#if MUSIC_STATISTICS
+  ++_statistics.nCancelResets;
+#endif
+
+  finishCancel();
+}
+
+
+void CMusic::finishCancel()
+{
+  // Once SM_CANCEL has cleared, the VS1053b should have dropped whatever
+  // was left of the file and be looking for the start of the next one,
+  // which SCI_HDAT1 confirms by being zero; there's no need to flush its
+  // buffer as well. If it's still decoding something, flush anyway. After
+  // a software reset, there's nothing left to flush.
+
+  _actionBuffer = ACTION_BUFFER_NONE;
+
+  if (_reset == RESET_NONE && read<Register::SCI_HDAT1>() != 0)
+    _nBytesFlushRemaining = 2052;
+
+#if MUSIC_STATISTICS
+  if (_microsCancel != 0) {
+    _statistics.microsCancel = micros() - _microsCancel;
+
+    if (_statistics.microsCancel > _statistics.microsCancelMax)
+      _statistics.microsCancelMax = _statistics.microsCancel;
+
+    _microsCancel = 0;
+  }
+#endif
+}
+
+
+bool CMusic::serviceRecord(bool& active)
+{
+  // One round of loop() while recording: read what the VS1053b has encoded
+  // so far, up to 256 bytes (one IMA ADPCM block), then write at most one
+  // full block to the SD card. Reading first means that the VS1053b is
+  // drained right after each write, however long the SD card took. Don't
+  // bother with less than a 32-byte chunk unless that's all that fits
+  // before the end of the buffer or the end of the recording.
+
+  bool more = false;
+
+  uint16_t nWords = (_record.stop ? _record.nWordsStop : read<Register::SCI_HDAT1>());
+
+  size_t offsetRead  = _record.nBytesRead % _record.nBytesBuffer;
+  size_t nBytesFree  = _record.nBytesBuffer - (size_t) (_record.nBytesRead - _record.nBytesWritten);
+  size_t nBytesToEnd = _record.nBytesBuffer - offsetRead;
+
+  if (nBytesFree > nBytesToEnd)
+    nBytesFree = nBytesToEnd;
+  if (nBytesFree > 256)
+    nBytesFree = 256;
+
+  if (nWords > nBytesFree / 2)
+    nWords = nBytesFree / 2;
+
+  if (nWords > 0 && (nWords >= 16 || nWords == nBytesFree / 2 || _record.stop)) {
+    unsigned char* bytes = _record.buffer + offsetRead;
+
+    // most significant byte first, as the words come out of the encoder,
+    // all of them in a single SPI transaction
+
+    Register::ReadBurst burst(*this, Register::SCI_HDAT0::address);
+
+    for (uint16_t iWord = 0; iWord < nWords; ++iWord) {
+      uint16_t value = burst.read();
+
+      *bytes++ = (uint8_t) (value >> 8);
+      *bytes++ = (uint8_t) (value >> 0);
+    }
+
+    _record.nBytesRead += 2 * nWords;
+
+    if (_record.stop)
+      _record.nWordsStop -= nWords;
+
+#if MUSIC_STATISTICS
+    _statistics.nBytesRecorded += 2 * nWords;
+#endif
+
+    more = true;
+  }
+
+  if (_record.nBytesRead - _record.nBytesWritten >= 512) {
+    if (writeRecord(512) < 512) {
+      // out of space on the SD card; keep what's there
+
+      _record.nWordsStop = 0;
+      _record.stop = true;
+    }
+
+    more = true;
+  }
+
+  if (_record.stop && _record.nWordsStop == 0) {
+    finishRecord();
+    more = false;
+  }
+
+  if (more)
+    active = true;
+
+  return more;
+}
+
+
+void CMusic::finishRecord()
+{
+  // Write whatever is left in the buffer, then go back and fill in the
+  // header. The software reset stops the encoder and restores everything
+  // for playback.
+
+  File& file = *_record.file;
+
+  while (_record.nBytesWritten < _record.nBytesRead) {
+    size_t nBytesToEnd = _record.nBytesBuffer - _record.nBytesWritten % _record.nBytesBuffer;
+    size_t nBytes      = (size_t) (_record.nBytesRead - _record.nBytesWritten);
+
+    if (nBytes > nBytesToEnd)
+      nBytes = nBytesToEnd;
+
+    if (writeRecord(nBytes) < nBytes)
+      break;
+  }
+
+  unsigned char header[60];
+
+  headerRecord(header, _record.sampleRate, _record.nBytesWritten > 60 ? _record.nBytesWritten - 60 : 0);
+
+  file.seek(0);
+  file.write(header, sizeof(header));
+  file.flush();
+
+  reset(false, false);
+}
+
+
+size_t CMusic::writeRecord(size_t nBytes)
+{
+  // never across the end of the buffer
+
+#if MUSIC_STATISTICS
+  unsigned long microsStart = micros();
+#endif
+
+  size_t nBytesWritten = _record.file->write(_record.buffer + _record.nBytesWritten % _record.nBytesBuffer, nBytes);
+
+  _record.nBytesWritten += nBytesWritten;
+
+#if MUSIC_STATISTICS
+  unsigned long microsWrite = micros() - microsStart;
+
+  ++_statistics.nWrites;
+  _statistics.microsWrite += microsWrite;
+
+  if (microsWrite > _statistics.microsWriteMax)
+    _statistics.microsWriteMax = microsWrite;
+#endif
+
+  return nBytesWritten;
+}
+
+
+void CMusic::headerRecord(unsigned char* bytes, uint16_t sampleRate, uint32_t nBytesData)
+{
+  // RIFF WAVE header for mono IMA ADPCM in 256-byte blocks of 505 samples
+  // each, as given in the datasheet
+
+  uint32_t const fields[] = {
+    0x46464952,                         // "RIFF"
+    52 + nBytesData,                    // size of the rest of the file
+    0x45564157,                         // "WAVE"
+    0x20746D66,                         // "fmt "
+    20,                                 // size of the format chunk
+    0x00010011,                         // format IMA ADPCM, one channel
+    sampleRate,                         // samples per second
+    (uint32_t) sampleRate * 256 / 505,  // bytes per second
+    0x00040100,                         // 256 bytes per block, 4 bits per sample
+    0x01F90002,                         // two extra bytes: 505 samples per block
+    0x74636166,                         // "fact"
+    4,                                  // size of the fact chunk
+    nBytesData / 256 * 505,             // number of samples in whole blocks
+    0x61746164,                         // "data"
+    nBytesData,                         // size of the data chunk
+  };
+
+  // little-endian
+
+  for (size_t iField = 0; iField < sizeof(fields) / sizeof(*fields); ++iField) {
+    *bytes++ = (uint8_t) (fields[iField] >>  0);
+    *bytes++ = (uint8_t) (fields[iField] >>  8);
+    *bytes++ = (uint8_t) (fields[iField] >> 16);
+    *bytes++ = (uint8_t) (fields[iField] >> 24);
+  }
+}
+
+
+bool CMusic::enableInterrupt()
+{
+  // Have the DREQ pin trigger a pin change interrupt whose handler
+  // calls interrupt(). Tell the SPI library about it, so that other
+  // libraries using SPI transactions (like SD) hold it off while they
+  // are talking to their own devices.
+
+  uint8_t address = _pinRequest.address();
+
+  if (!digitalPinToPCICR(address))
     return false;
 
-  _actionCancel = ACTION_CANCEL_SET_IMMEDIATE;
-  _actionBuffer = ACTION_BUFFER_CLOSE_AFTER_CANCEL;
+  SPI.usingInterrupt(255);
+
+  *digitalPinToPCMSK(address) |= _BV(digitalPinToPCMSKbit(address));
+  *digitalPinToPCICR(address) |= _BV(digitalPinToPCICRbit(address));
+
+  _interrupt = true;
 
   return true;
 }
 
 
-bool CMusic::loop(unsigned long msecMax)
+void CMusic::disableInterrupt()
 {
-  bool active = false;
+  uint8_t address = _pinRequest.address();
 
-  unsigned long msecStart = (msecMax != 0 ? millis() : 0);
+  if (digitalPinToPCICR(address))
+    *digitalPinToPCMSK(address) &= ~_BV(digitalPinToPCMSKbit(address));
 
-  for (;;) {
-    if (msecMax != 0 && millis() - msecStart > msecMax)
-      return active;
+  _interrupt = false;
+}
 
-    if (state() == STATE_IDLE
-        && _actionCancel == ACTION_CANCEL_NONE
-        && _actionBuffer == ACTION_BUFFER_NONE)
-      return active;
 
-    if (_cancel) {
-      uint16_t mode = read<Register::SCI_MODE>();
+void CMusic::interrupt()
+{
+  // Only ever send audio that's already in the buffer, and only while
+  // plainly playing; refilling the buffer from the SD card and anything
+  // to do with flushing and cancelling is left to loop(). So is feeding
+  // the mixer, which doesn't wait for the room this leaves in SDI.
 
-      if (!(mode & Register::SM_CANCEL))
-        _cancel = false;
+  if (_lock || !_interrupt)
+    return;
 
-      active = true;
-    }
-    else if (_actionCancel == ACTION_CANCEL_SET_IMMEDIATE) {
-      uint16_t mode = read<Register::SCI_MODE>();
+  if (_cancel
+      || _nBytesFlushRemaining > 0
+      || _actionBuffer != ACTION_BUFFER_NONE
+      || !_buffer.active())
+    return;
 
-      if (!(mode & Register::SM_CANCEL))
-        write<Register::SCI_MODE>(mode | Register::SM_CANCEL);
+  for (uint8_t iChunk = 0; iChunk < MUSIC_INTERRUPT_CHUNKS; ++iChunk) {
+    if (_pinRequest == LOW || sendAudio(32) == 0)
+      break;
+  }
+}
 
-      _cancel = true;
-      _actionCancel = ACTION_CANCEL_NONE;
 
-      active = true;
-    }
+CMusic::Format CMusic::format(unsigned char const* bytes, size_t nBytes)
+{
+  if (nBytes < 3)
+    return FORMAT_UNKNOWN;
 
-    if (_pinRequest == LOW)
-      return active;
+  if (bytes[0] == 'I' && bytes[1] == 'D' && bytes[2] == '3')
+    return FORMAT_MPEG;
 
-    active = true;
+  if (bytes[0] == 0xFF && (bytes[1] & 0xF0) == 0xF0 && (bytes[1] & 0x06) == 0x00)
+    return FORMAT_ADTS;
 
-    if (_cancel) {
-      size_t nBytesAudioSent = 0;
+  if (bytes[0] == 0xFF && (bytes[1] & 0xE0) == 0xE0 && (bytes[1] & 0x06) != 0x00)
+    return FORMAT_MPEG;
 
-      if (_buffer.active()) {
-        nBytesAudioSent = sendAudio(32);
+  return FORMAT_UNKNOWN;
+}
 
-        if (nBytesAudioSent < 32)
-          _buffer.close();
-      }
 
-      if (nBytesAudioSent < 32)
-        sendFlush(32 - nBytesAudioSent);
-    }
-    else {
-      if (_actionBuffer == ACTION_BUFFER_CLOSE_AFTER_CANCEL) {
-        _nBytesFlushRemaining = 2052;
-        _buffer.close();
-        _actionBuffer = ACTION_BUFFER_NONE;
-      }
+CMusic::Format CMusic::format(File& file)
+{
+  // the format of whatever follows an ID3v2 tag, which play() skips
 
-      size_t nBytesAudioSent = 0;
+  unsigned char bytes[3];
 
-      if (_buffer.active()) {
-        nBytesAudioSent = sendAudio(32);
+  uint32_t position = file.position();
+  skipTag(file);
+  int nBytes = file.read(bytes, sizeof(bytes));
+  file.seek(position);
 
-        if (nBytesAudioSent < 32) {
-          _nBytesFlushRemaining = 2052;
-          _buffer.close();
-        }
-      }
+  return (nBytes > 0 ? format(bytes, nBytes) : FORMAT_UNKNOWN);
+}
 
-      if (_nBytesFlushRemaining > 0) {
-        size_t nBytesFlushSent = sendFlush(32 - nBytesAudioSent);
 
-        if (_nBytesFlushRemaining > nBytesFlushSent) {
-          _nBytesFlushRemaining -= nBytesFlushSent;
-        }
-        else {
-          _nBytesFlushRemaining = 0;
-          if (_actionCancel == ACTION_CANCEL_SET_AFTER_FLUSH)
-            _actionCancel = ACTION_CANCEL_SET_IMMEDIATE;
-        }
-      }
-    }
+uint32_t CMusic::tagSize(unsigned char const* bytes, size_t nBytes)
+{
+  // Size of an ID3v2 tag, header and footer included, or zero if the
+  // bytes don't start with one. Its size is stored as a syncsafe integer,
+  // seven bits per byte, and doesn't count the 10-byte header.
+
+  if (nBytes < 10
+      || bytes[0] != 'I' || bytes[1] != 'D' || bytes[2] != '3'
+      || bytes[3] == 0xFF || bytes[4] == 0xFF
+      || ((bytes[6] | bytes[7] | bytes[8] | bytes[9]) & 0x80) != 0)
+    return 0;
+
+  uint32_t nBytesTag =
+      ((uint32_t) bytes[6] << 21)
+    | ((uint32_t) bytes[7] << 14)
+    | ((uint32_t) bytes[8] <<  7)
+    | ((uint32_t) bytes[9] <<  0);
+
+  return 10 + nBytesTag + ((bytes[5] & 0x10) ? 10 : 0);
+}
+
+
+void CMusic::skipTag(File& file)
+{
+  // leave the file behind an ID3v2 tag at its position, if there is one
+
+  unsigned char bytes[10];
+
+  uint32_t position = file.position();
+  int nBytes = file.read(bytes, sizeof(bytes));
+
+  file.seek(position + (nBytes > 0 ? tagSize(bytes, nBytes) : 0));
+}
+
+
+uint32_t CMusic::findEnd(File& file)
+{
+  // leaves the file where it was
+
+  uint32_t position = file.position();
+
+  TailFile tail(file);
+  uint32_t end = findEnd(tail, position, file.size());
+
+  file.seek(position);
+
+  return end;
+}
+
+
+template<class TTail>
+uint32_t CMusic::findEnd(TTail& tail, uint32_t position, uint32_t end)
+{
+  // Where the audio in a file ends: in front of an ID3v1 tag in its last
+  // 128 bytes, and in front of an APEv2 tag before that (or at the very
+  // end), which is found by its 32-byte footer. The footer tells the size
+  // of the tag's items plus itself, and whether a 32-byte header precedes
+  // them. Never before the given position, which has been read up to
+  // already; whatever of a tag lies in front of it can't be taken back.
+
+  unsigned char bytes[32];
+
+  if (end >= position + 128) {
+    if (tail.read(end - 128, bytes, 3) && bytes[0] == 'T' && bytes[1] == 'A' && bytes[2] == 'G')
+      end -= 128;
+  }
+
+  if (end >= position + 32) {
+    if (tail.read(end - 32, bytes, 32) && memcmp(bytes, "APETAGEX", 8) == 0) {
+      uint32_t nBytesTag =
+          ((uint32_t) bytes[15] << 24)
+        | ((uint32_t) bytes[14] << 16)
+        | ((uint32_t) bytes[13] <<  8)
+        | ((uint32_t) bytes[12] <<  0);
+
+      if (bytes[23] & 0x80)
+        nBytesTag += 32;
 
-    _buffer.refill(32);
+      if (nBytesTag <= end)
+        end = (end - nBytesTag > position ? end - nBytesTag : position);
+    }
   }
+
+  return end;
+}
+
+
+bool CMusic::lookupBank(File& bank, uint16_t index, uint32_t& position, uint32_t& nBytes)
+{
+  // A sound bank starts with "MBNK" and the number of clips (16 bits),
+  // two reserved bytes, and then an 8-byte entry per clip: where its
+  // audio starts in the bank and how many bytes it has (32 bits each).
+  // All little-endian. Up to 63 entries share the header's block, which
+  // the SD library keeps cached for the second read.
+
+  unsigned char bytes[8];
+
+  if (!bank.seek(0)
+      || bank.read(bytes, 8) != 8
+      || memcmp(bytes, "MBNK", 4) != 0
+      || index >= ((uint16_t) bytes[5] << 8 | bytes[4]))
+    return false;
+
+  if (!bank.seek(8 + (uint32_t) index * 8)
+      || bank.read(bytes, 8) != 8)
+    return false;
+
+  position =
+      ((uint32_t) bytes[3] << 24)
+    | ((uint32_t) bytes[2] << 16)
+    | ((uint32_t) bytes[1] <<  8)
+    | ((uint32_t) bytes[0] <<  0);
+
+  nBytes =
+      ((uint32_t) bytes[7] << 24)
+    | ((uint32_t) bytes[6] << 16)
+    | ((uint32_t) bytes[5] <<  8)
+    | ((uint32_t) bytes[4] <<  0);
+
+  uint32_t size = bank.size();
+
+  return (nBytes > 0 && position <= size && nBytes <= size - position);
 }
 
 
@@ -572,47 +3191,306 @@ inline size_t CMusic::sendAudio(size_t nBytesMax)
   if (nBytesRead > nBytesMax)
     nBytesRead = nBytesMax;
 
+#if MUSIC_STATISTICS
+  // Only ever called while DREQ is high, so an empty buffer before the
+  // end of the file means the VS1053b is kept waiting for data. Count
+  // each such stretch once.
+
+  if (nBytesRead == 0 && !_buffer.eof()) {
+    if (!_underrun)
+      ++_statistics.nUnderruns;
+    _underrun = true;
+  }
+  else {
+    _underrun = false;
+  }
+
+  _statistics.nBytesSent += nBytesRead;
+#endif
+
+  if (nBytesRead == 0)
+    return 0;
+
+  SPI.beginTransaction(_spiData);
+
   _pinSelectData = LOW;
 
-  for (size_t iByte = 0; iByte < nBytesRead; ++iByte)
-    SPI.transfer(_buffer.read());
+  // at most three spans: a clip's head, if there's any left of it, then
+  // up to the end of the ring buffer, then from its start
+
+  for (size_t nBytesSent = 0; nBytesSent < nBytesRead; ) {
+    size_t nBytesSpan = _buffer.contiguous();
+
+    if (nBytesSpan > nBytesRead - nBytesSent)
+      nBytesSpan = nBytesRead - nBytesSent;
+
+    if (_buffer.progmem())
+           sendBurst_P(_buffer.data(), nBytesSpan);
+      else sendBurst  (_buffer.data(), nBytesSpan);
+
+    _buffer.skip(nBytesSpan);
+
+    nBytesSent += nBytesSpan;
+  }
 
   _pinSelectData = HIGH;
 
+  SPI.endTransaction();
+
   return nBytesRead;
 }
 
 
 inline size_t CMusic::sendFlush(size_t nBytesMax)
 {
+  if (nBytesMax == 0)
+    return 0;
+
+  SPI.beginTransaction(_spiData);
+
   _pinSelectData = LOW;
 
-  for (size_t iByte = 0; iByte < nBytesMax; ++iByte)
-    SPI.transfer(0x00);
+  sendBurst(_endFillByte, nBytesMax);
   
   _pinSelectData = HIGH;
 
+  SPI.endTransaction();
+
   return nBytesMax;
 }
 
 
+inline void CMusic::refill()
+{
+#if MUSIC_STATISTICS
+  if (!_buffer.refillable())
+    return;
+
+  unsigned long microsStart = micros();
+
+  _buffer.refill();
+
+  unsigned long microsRefill = micros() - microsStart;
+
+  ++_statistics.nRefills;
+  _statistics.microsRefill += microsRefill;
+
+  if (microsRefill > _statistics.microsRefillMax)
+    _statistics.microsRefillMax = microsRefill;
+#else
+  _buffer.refill();
+#endif
+}
+
+
+inline void CMusic::sendBurst(unsigned char const* bytes, size_t nBytes)
+{
+  // Write SPDR directly instead of going through SPI.transfer() and
+  // fetch the next byte while the current one is still being shifted
+  // out, so that each byte costs little more than its time on the wire.
+  //
+  // At 16 MHz and SPI_CLOCK_DIV4, a byte takes 32 cycles to shift out.
+  // One 32-byte chunk used to cost about 1800 cycles (bounds-checked
+  // Buffer::read() plus SPI.transfer() for every byte); in burst mode
+  // it costs about 1150 cycles, most of which is spent on the wire. At
+  // SPI_CLOCK_DIV2, which _spiData allows once the clock multiplier is
+  // set, a byte takes 16 cycles, close to what it takes to fetch the next.
+
+  SPDR = *bytes++;
+
+  while (--nBytes) {
+    unsigned char byteNext = *bytes++;
+    while (!(SPSR & _BV(SPIF)));
+    SPDR = byteNext;
+  }
+
+  while (!(SPSR & _BV(SPIF)));
+
+  (void) SPDR;  // clear SPIF for whoever uses the bus next
+}
+
+
+inline void CMusic::sendBurst_P(unsigned char const* bytes, size_t nBytes)
+{
+  // same as sendBurst(), but from program memory
+
+  SPDR = pgm_read_byte(bytes++);
+
+  while (--nBytes) {
+    unsigned char byteNext = pgm_read_byte(bytes++);
+    while (!(SPSR & _BV(SPIF)));
+    SPDR = byteNext;
+  }
+
+  while (!(SPSR & _BV(SPIF)));
+
+  (void) SPDR;  // clear SPIF for whoever uses the bus next
+}
+
+
+inline void CMusic::sendBurst(unsigned char value, size_t nBytes)
+{
+  SPDR = value;
+
+  while (--nBytes) {
+    while (!(SPSR & _BV(SPIF)));
+    SPDR = value;
+  }
+
+  while (!(SPSR & _BV(SPIF)));
+
+  (void) SPDR;  // clear SPIF for whoever uses the bus next
+}
+
+
+void CMusic::clearPosition(unsigned long msecPosition)
+{
+  // SCI_DECODE_TIME needs to be written twice to be sure it sticks, see
+  // the datasheet
+
+  write<Register::SCI_DECODE_TIME>(msecPosition / 1000);
+  write<Register::SCI_DECODE_TIME>(msecPosition / 1000);
+
+  _msecPosition       = msecPosition;
+  _msecPositionUpdate = millis();
+
+  // whatever comes next may well be at a different bit rate
+
+  _byteRate = 0;
+}
+
+
+void CMusic::updatePosition()
+{
+  // positionMsec is only maintained for some formats (and is -1 for all
+  // others); SCI_DECODE_TIME is always there, but in whole seconds. Carry
+  // on counting milliseconds from the previous update then, but stay
+  // within the second that the VS1053b reports.
+
+  unsigned long msecUpdate = millis();
+  uint32_t msecPosition = read<Memory::parametric_positionMsec>();
+
+  if (msecPosition == 0xFFFFFFFF) {
+    unsigned long msecSecond = 1000UL * read<Register::SCI_DECODE_TIME>();
+
+    msecPosition = _msecPosition + (msecUpdate - _msecPositionUpdate);
+
+    if (msecPosition < msecSecond)
+      msecPosition = msecSecond;
+    if (msecPosition > msecSecond + 999)
+      msecPosition = msecSecond + 999;
+  }
+
+  _msecPosition       = msecPosition;
+  _msecPositionUpdate = msecUpdate;
+}
+
+
+void CMusic::updateByteRate()
+{
+  // parametric_byteRate is only meaningful once the VS1053b has made out
+  // what it's decoding, which is when SCI_HDAT1 is no longer zero. After
+  // that, it only needs refreshing for variable bit rates.
+
+  if (_byteRate == 0 && read<Register::SCI_HDAT1>() == 0)
+    return;
+
+  _byteRate = read<Memory::parametric_byteRate>();
+}
+
+
+void CMusic::fade(uint8_t volume, unsigned long msecDuration)
+{
+  Lock lock(*this);
+
+  if (msecDuration == 0) {
+    this->volume(volume);
+    return;
+  }
+
+  _volumeFadeFrom = _volume;
+  _volumeFadeTo   = volume;
+  _msecFadeStart  = millis();
+  _msecFade       = msecDuration;
+}
+
+
+void CMusic::fadeIn(unsigned long msecDuration, uint8_t volume)
+{
+  Lock lock(*this);
+
+  this->volume(0);
+  fade(volume, msecDuration);
+}
+
+
+void CMusic::updateFade()
+{
+  // Called once per loop(). Works out where the fade should be by now,
+  // however long it's been since the last call, and only touches SCI_VOL
+  // if that makes a difference.
+
+  if (_msecFade == 0)
+    return;
+
+  unsigned long msecElapsed = millis() - _msecFadeStart;
+
+  uint8_t volume;
+
+  if (msecElapsed >= _msecFade) {
+    volume = _volumeFadeTo;
+    _msecFade = 0;
+  }
+  else {
+    volume = _volumeFadeFrom + (int32_t) ((int16_t) _volumeFadeTo - _volumeFadeFrom) * (int32_t) msecElapsed / (int32_t) _msecFade;
+  }
+
+  if (volume == _volume)
+    return;
+
+  _volume = volume;
+  updateVolumeAndBalance();
+}
+
+
 void CMusic::updateVolumeAndBalance()
 {
+  Lock lock(*this);
+
+  // left to wake(), as SCI_VOL is what keeps the analog side powered down,
+  // or to loop() once a reset is done
+
+  if (_poweredDown || _reset != RESET_NONE)
+    return;
+
   // SCI_VOL expects relative sound pressure level in units of -0.5 dB,
   // going from 0 dB (max loudness x 1) to -127.5 dB (x 0.00015).
   //
   // Since dB are an unintuitive way to specify subjective loudness,
   // use a lookup table to convert a linear amplitude scale that goes
   // from 0 (silence) to 255 (max loudness) to the expected dB value.
+  // There's an entry for every volume, so that fades don't step.
   //
   // loudness / 255 = 2 ** (10 * (SCI_VOL / -0.5))
   // SCI_VOL = -(1/0.5 * 10 * log[2](loudness / 255))
 
-  static uint8_t const level[32] PROGMEM = {
-    /* loudness =  0 ..  7 */  254,  99,  79,  67,  59,  53,  47,  43,
-    /* loudness =  8 .. 15 */   39,  36,  33,  30,  27,  25,  23,  21,
-    /* loudness = 16 .. 23 */   19,  17,  16,  14,  13,  11,  10,   9,
-    /* loudness = 24 .. 31 */    7,   6,   5,   4,   3,   2,   1,   0,
+  static uint8_t const level[256] PROGMEM = {
+    /* volume =   0 ..  15 */  254, 160, 140, 128, 120, 113, 108, 104, 100,  96,  93,  91,  88,  86,  84,  82,
+    /* volume =  16 ..  31 */   80,  78,  76,  75,  73,  72,  71,  69,  68,  67,  66,  65,  64,  63,  62,  61,
+    /* volume =  32 ..  47 */   60,  59,  58,  57,  56,  56,  55,  54,  53,  53,  52,  51,  51,  50,  49,  49,
+    /* volume =  48 ..  63 */   48,  48,  47,  46,  46,  45,  45,  44,  44,  43,  43,  42,  42,  41,  41,  40,
+    /* volume =  64 ..  79 */   40,  39,  39,  39,  38,  38,  37,  37,  36,  36,  36,  35,  35,  35,  34,  34,
+    /* volume =  80 ..  95 */   33,  33,  33,  32,  32,  32,  31,  31,  31,  30,  30,  30,  29,  29,  29,  28,
+    /* volume =  96 .. 111 */   28,  28,  28,  27,  27,  27,  26,  26,  26,  26,  25,  25,  25,  25,  24,  24,
+    /* volume = 112 .. 127 */   24,  23,  23,  23,  23,  22,  22,  22,  22,  22,  21,  21,  21,  21,  20,  20,
+    /* volume = 128 .. 143 */   20,  20,  19,  19,  19,  19,  19,  18,  18,  18,  18,  18,  17,  17,  17,  17,
+    /* volume = 144 .. 159 */   16,  16,  16,  16,  16,  16,  15,  15,  15,  15,  15,  14,  14,  14,  14,  14,
+    /* volume = 160 .. 175 */   13,  13,  13,  13,  13,  13,  12,  12,  12,  12,  12,  12,  11,  11,  11,  11,
+    /* volume = 176 .. 191 */   11,  11,  10,  10,  10,  10,  10,  10,   9,   9,   9,   9,   9,   9,   8,   8,
+    /* volume = 192 .. 207 */    8,   8,   8,   8,   8,   7,   7,   7,   7,   7,   7,   7,   6,   6,   6,   6,
+    /* volume = 208 .. 223 */    6,   6,   6,   5,   5,   5,   5,   5,   5,   5,   5,   4,   4,   4,   4,   4,
+    /* volume = 224 .. 239 */    4,   4,   3,   3,   3,   3,   3,   3,   3,   3,   2,   2,   2,   2,   2,   2,
+    /* volume = 240 .. 255 */    2,   2,   2,   1,   1,   1,   1,   1,   1,   1,   1,   0,   0,   0,   0,   0,
   };
 
   uint8_t attenuationLeft  = (_balance > 0 ? (int16_t) _volume * _balance /  127 : 0);
@@ -622,8 +3500,10 @@ void CMusic::updateVolumeAndBalance()
   uint8_t volumeRight = (_volume > attenuationRight ? _volume - attenuationRight : 0);
 
   uint16_t levelCombined =
-      (uint16_t) pgm_read_byte(level + (volumeLeft  / 8)) << 8
-    | (uint16_t) pgm_read_byte(level + (volumeRight / 8)) << 0;
+      (uint16_t) pgm_read_byte(level + volumeLeft ) << 8
+    | (uint16_t) pgm_read_byte(level + volumeRight) << 0;
+
+  // skipped by the register shadow if it's the same as before
 
   write<Register::SCI_VOL>(levelCombined);
 }
@@ -16,6 +16,7 @@
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <limits.h>
 
 #include <Arduino.h>
 #include <SPI.h>
@@ -24,6 +25,93 @@
 #include "Pin.h"
 
 
+// Size of the ring buffer that holds audio data read from the SD card
+// until it is sent to the VS1053b. Must be a power of two. Larger values
+// mean fewer (and larger) SD reads, at the expense of precious RAM.
+
+#ifndef MUSIC_BUFFER_SIZE
+#define MUSIC_BUFFER_SIZE 256
+#endif
+
+
+// Number of files that can be queued up for playback after the current one.
+
+#ifndef MUSIC_QUEUE_SIZE
+#define MUSIC_QUEUE_SIZE 4
+#endif
+
+
+// Number of clips that can be registered with clip() or clip_P() for
+// playback with playClip().
+
+#ifndef MUSIC_CLIP_COUNT
+#define MUSIC_CLIP_COUNT 4
+#endif
+
+
+// Maximum number of 32-byte chunks sent to the VS1053b per call of
+// interrupt(), which bounds the time spent in the interrupt handler.
+
+#ifndef MUSIC_INTERRUPT_CHUNKS
+#define MUSIC_INTERRUPT_CHUNKS 8
+#endif
+
+
+// Minimum number of milliseconds between two updates of the playback
+// position from the VS1053b, which each take a few SCI transactions.
+
+#ifndef MUSIC_POSITION_INTERVAL
+#define MUSIC_POSITION_INTERVAL 200
+#endif
+
+
+// Number of milliseconds that deadline() keeps in reserve for loop() to
+// read from the SD card and catch up before the VS1053b runs dry.
+
+#ifndef MUSIC_DEADLINE_MARGIN
+#define MUSIC_DEADLINE_MARGIN 10
+#endif
+
+
+// Samples per second that VLSI's PCM mixer plugin takes from its FIFO,
+// which deadline() counts on while a sound effect plays. The library
+// can't tell how the plugin is set up, so it assumes the fastest.
+
+#ifndef MUSIC_MIXER_RATE
+#define MUSIC_MIXER_RATE 48000
+#endif
+
+
+// Number of bands of VLSI's spectrum analyzer plugin that loop() keeps
+// for spectrum(), and the minimum number of milliseconds between two
+// readouts, which each take an SCI read per band.
+
+#ifndef MUSIC_SPECTRUM_BANDS
+#define MUSIC_SPECTRUM_BANDS 14
+#endif
+
+#ifndef MUSIC_SPECTRUM_INTERVAL
+#define MUSIC_SPECTRUM_INTERVAL 40
+#endif
+
+
+// Number of milliseconds that loop() waits for the VS1053b to raise DREQ
+// after each step of a reset before giving up on it with STATE_ERROR.
+
+#ifndef MUSIC_RESET_TIMEOUT
+#define MUSIC_RESET_TIMEOUT 100
+#endif
+
+
+// Set to 1 to have the library keep playback statistics, which are
+// returned by statistics(). Costs a few dozen bytes of RAM and a couple
+// of calls to micros() per loop().
+
+#ifndef MUSIC_STATISTICS
+#define MUSIC_STATISTICS 0
+#endif
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  CMusic
@@ -42,23 +130,96 @@ public:
 
   void reset(bool hardware = true, bool settings = true);
 
+  bool load(uint16_t const* plugin, size_t nWords);
+  bool load(File& plugin);
+
+  bool loadSpectrum(uint16_t const* plugin, size_t nWords);
+  bool loadSpectrum(File& plugin);
+  uint8_t spectrum(uint8_t* levels, uint8_t nLevelsMax);
+  uint8_t level();
+
+  bool loadMixer(uint16_t const* plugin, size_t nWords);
+  bool loadMixer(File& plugin);
+  bool overlay(unsigned char const* samples, size_t nBytes);
+  bool overlay_P(unsigned char const* samples, size_t nBytes);
+  bool overlay(File& samples, unsigned char* buffer, size_t nBytesBuffer);
+  bool overlaying();
+  void cancelOverlay();
+
   enum State {
     STATE_IDLE,
     STATE_PLAYING,
     STATE_BUSY,
+    STATE_RECORDING,
+    STATE_RESETTING,
+    STATE_ERROR,
   };
 
   State state();
 
   bool play(File& source);
+  bool play(Sd2Card& card, SdFile& source);
+  bool play(Stream& source);
+  bool play(unsigned char const* source, size_t nBytes);
+  bool play_P(unsigned char const* source, size_t nBytes);
+  bool queue(File& source);
+
+  bool clip(uint8_t index, File& file, unsigned char* buffer, size_t nBytesBuffer);
+  bool clip_P(uint8_t index, File& file, unsigned char const* head, size_t nBytesHead);
+  bool playClip(uint8_t index);
+  bool playBank(File& bank, uint16_t index);
+  bool record(File& target, unsigned char* buffer, size_t nBytesBuffer, uint16_t sampleRate = 8000, bool line = false);
+  uint8_t queued();
   bool cancel();
+  bool seek(long msecDelta);
   bool loop(unsigned long msecMax = 0);
 
+  static bool loopAll(unsigned long msecMax = 0);
+
+  unsigned long deadline();
+  static unsigned long deadlineAll();
+
+  void powerDownAfter(unsigned long msecIdle);
+  bool poweredDown();
+
+  bool enableInterrupt();
+  void disableInterrupt();
+  void interrupt();
+
+  unsigned long position();
   int time();
 
+  struct Statistics {
+    uint32_t nBytesSent;         // audio bytes sent to the VS1053b
+    uint32_t nLoopsRequestLow;   // loop() calls that found the VS1053b busy
+    uint32_t nLoopsRequestHigh;  // loop() calls that found it asking for data
+    uint32_t nUnderruns;         // times it asked for data with the buffer empty
+    uint32_t microsLoopGapMax;   // longest time between loop() calls while playing
+    uint32_t nRefills;           // reads from the SD card
+    uint32_t microsRefill;       // total time spent reading from the SD card
+    uint32_t microsRefillMax;    // longest single read from the SD card
+    uint32_t nBytesRecorded;     // bytes read from the VS1053b while recording
+    uint32_t nWrites;            // blocks written to the SD card while recording
+    uint32_t microsWrite;        // total time spent writing to the SD card
+    uint32_t microsWriteMax;     // longest single write to the SD card
+    uint32_t microsCancel;       // time from the latest cancel() until idle
+    uint32_t microsCancelMax;    // longest time from cancel() until idle
+    uint32_t nCancelResets;      // cancels that took a software reset to finish
+  };
+
+#if MUSIC_STATISTICS
+  Statistics const& statistics();
+  void clearStatistics();
+#endif
+
   void volume(uint8_t volume);
   uint8_t volume();
 
+  void fade(uint8_t volume, unsigned long msecDuration);
+  void fadeIn(unsigned long msecDuration, uint8_t volume = 255);
+  void fadeOut(unsigned long msecDuration);
+  bool fading();
+
   void balance(int8_t balance);
   int8_t balance();
 
@@ -68,6 +229,34 @@ private:
 
   class Register;
   class Memory;
+  class Lock;
+
+  class PluginProgmem;
+  class PluginFile;
+
+  class TailFile;
+  class TailSectors;
+
+  template<class TPlugin>
+  bool loadPlugin(TPlugin& plugin);
+
+  enum Format {
+    FORMAT_UNKNOWN,
+    FORMAT_MPEG,  // MPEG 1/2 Layer I, II, III (optionally with ID3v2 tag)
+    FORMAT_ADTS,  // AAC in ADTS frames
+  };
+
+  static Format format(unsigned char const* bytes, size_t nBytes);
+  static Format format(File& file);
+
+  static uint32_t tagSize(unsigned char const* bytes, size_t nBytes);
+  static void skipTag(File& file);
+  static uint32_t findEnd(File& file);
+
+  template<class TTail>
+  static uint32_t findEnd(TTail& tail, uint32_t position, uint32_t end);
+
+  static bool lookupBank(File& bank, uint16_t index, uint32_t& position, uint32_t& nBytes);
 
   template<class TReadable>
   typename TReadable::Value read();
@@ -78,14 +267,78 @@ private:
   size_t sendAudio(size_t nBytesMax);
   size_t sendFlush(size_t nBytesMax);
 
+  static void sendBurst(unsigned char const* bytes, size_t nBytes);
+  static void sendBurst_P(unsigned char const* bytes, size_t nBytes);
+  static void sendBurst(unsigned char value, size_t nBytes);
+
   void updateVolumeAndBalance();
+  void updateFade();
+
+  void powerDown();
+  void wake();
+
+  void countLoop();
+  bool service(bool& active);
+  bool serviceReset(bool& active);
+  void abortCancel();
+  void finishCancel();
+
+  void clearPosition(unsigned long msecPosition = 0);
+  void updatePosition();
+  void updateByteRate();
+  bool beginSpectrum();
+  void updateSpectrum();
+  bool beginMixer();
+  bool serviceOverlay(bool& active);
+
+  void refill();
+
+  bool serviceRecord(bool& active);
+  void finishRecord();
+  size_t writeRecord(size_t nBytes);
+
+  static void headerRecord(unsigned char* bytes, uint16_t sampleRate, uint32_t nBytesData);
 
   
+  // all instances that begin() has been called for, for loopAll()
+
+  static CMusic* _instances;
+  static CMusic* _instanceFirst;
+  CMusic* _instanceNext;
+
   PinDigital<OUTPUT> _pinReset;          // RESET
   PinDigital<INPUT>  _pinRequest;        // DREQ
   PinDigital<OUTPUT> _pinSelectData;     // SS_SDI
   PinDigital<OUTPUT> _pinSelectControl;  // SS_SCI
 
+  uint16_t _shadow[3];  // host-owned SCI registers, see Register
+  uint8_t _shadowValid;
+
+  // Own bus settings, applied in a transaction around every access, so
+  // that whatever else shares the bus can't slow SDI down or clock SCI
+  // faster than the VS1053b can follow. Both depend on SCI_CLOCKF.
+
+  void updateClock(uint16_t clockf);
+
+  SPISettings _spiControl;  // SCI, no faster than CLKI/7
+  SPISettings _spiData;     // SDI, no faster than CLKI/4
+
+  // The steps of reset() (and of the software reset that starts record())
+  // that loop() is still waiting on, and since when. RESET_ERROR stays
+  // until the next reset() if the VS1053b never came back.
+
+  enum Reset {
+    RESET_NONE,
+    RESET_HARDWARE,  // RESET pin held low
+    RESET_CLOCK,     // RESET pin released, waiting to set SCI_CLOCKF
+    RESET_SOFTWARE,  // SM_RESET set, waiting to enable I2S output
+    RESET_RECORD,    // SM_RESET and SM_ADPCM set, waiting to record
+    RESET_ERROR,
+  };
+
+  Reset _reset;
+  unsigned long _msecReset;
+
 
   template<size_t SIZE>
   class Buffer
@@ -94,23 +347,126 @@ private:
     Buffer();
 
     void open(File& file);
-    void refill(size_t nBytesMin);
+    void open(File& file, unsigned char const* direct, size_t nBytesDirect, bool progmem);
+    void open(File& file, uint32_t position, uint32_t nBytes);
+    bool open(Sd2Card& card, SdFile& file);
+    void open(Stream& stream);
+    void open(unsigned char const* direct, size_t nBytesDirect, bool progmem);
+    void append(File& file);
+    void findEnd();
+    bool uses(File const& file) const;
+    bool seekable() const;
+    int32_t seek(int32_t nBytesDelta);
+    bool refillable() const;
+    void refill();
     void close();
 
     bool active();
+    bool eof() const;
+    bool exhausted() const;
     size_t available() const;
 
-    unsigned char read();
+    bool direct() const;
+    bool progmem() const;
+
+    unsigned char const* data() const;
+    size_t contiguous() const;
+    void skip(size_t nBytes);
 
   private:
+    static_assert((SIZE & (SIZE - 1)) == 0, "buffer size must be a power of two");
+
+    size_t readFile(unsigned char* bytes, size_t nBytesMax);
+    size_t readSectors(unsigned char* bytes, size_t nBytesMax);
+    size_t readStream(unsigned char* bytes, size_t nBytesMax);
+
+    void skipTag();
+
+    // Picked by the open() overload, and looked at once per refill rather
+    // than once per byte. Memory sources have nothing to refill from: all
+    // of their bytes are handed out directly, like the head of a clip.
+
+    enum Source {
+      SOURCE_NONE,
+      SOURCE_FILE,
+      SOURCE_SECTORS,
+      SOURCE_STREAM,
+      SOURCE_MEMORY,
+    };
+
+    Source _source;
+    bool _eof;
+
     File* _file;
+    Stream* _stream;
+
+    Sd2Card* _card;
+    uint32_t _blockFirst;
+    uint32_t _positionFile;  // where the audio starts, as far as seek() goes
+    uint32_t _nBytesFile;    // where the audio ends, short of any trailing tags
+    bool _endPending;        // trailing tags not looked for yet
+    uint32_t _block;
+    uint16_t _offsetBlock;
+    uint32_t _nBytesRemaining;
+
     unsigned char _buffer[SIZE];
-    size_t _offset;
-    size_t _length;
+    size_t _head;
+    size_t _tail;
+    size_t _nBytesPrevious;  // left of the source before append()
+
+    unsigned char const* _direct;
+    size_t _nBytesDirect;
+    bool _directProgmem;
   };
 
 
-  Buffer<64> _buffer;
+  Buffer<MUSIC_BUFFER_SIZE> _buffer;
+
+  // Set while the foreground is using the SPI bus or changing playback
+  // state, so that interrupt() leaves both alone in the meantime.
+
+  bool volatile _lock;
+  bool _interrupt;
+
+  Format _format;
+
+  File*   _queue[MUSIC_QUEUE_SIZE];
+  Format  _queueFormat[MUSIC_QUEUE_SIZE];
+  uint8_t _queueHead;
+  uint8_t _queueLength;
+
+  bool playNext();
+  bool appendNext();
+  bool inUse(File const& file) const;
+  bool playMemory(unsigned char const* bytes, size_t nBytes, bool progmem);
+
+  struct Clip {
+    File* file;
+    unsigned char const* head;  // copy of the audio's first bytes, in RAM or PROGMEM
+    uint16_t nBytesHead;
+    uint32_t positionBody;      // where the file picks up after the head
+    bool progmem;
+    Format format;
+  };
+
+  Clip _clips[MUSIC_CLIP_COUNT];
+
+  // Encoded audio is read from the VS1053b into the caller's buffer and
+  // written to the SD card a whole block at a time. Both counts run from
+  // the start of the file, including its header.
+
+  struct Record {
+    File* file;
+    unsigned char* buffer;
+    uint16_t nBytesBuffer;      // whole 512-byte blocks
+    uint16_t sampleRate;
+    uint32_t nBytesRead;        // from the VS1053b into the buffer
+    uint32_t nBytesWritten;     // from the buffer to the SD card
+    uint16_t nWordsStop;        // left to read from the VS1053b before stopping
+    bool stop;
+  };
+
+  Record _record;
 
   bool _cancel;
 
@@ -130,10 +486,73 @@ private:
 
   size_t _nBytesFlushRemaining;
 
+  uint8_t _endFillByte;      // sent to flush the VS1053b, as it asks for
+  uint16_t _nBytesCancel;    // sent since SM_CANCEL was set
+  unsigned long _msecCancel; // when SM_CANCEL was set
+
   uint8_t _volume;
   int8_t _balance;
 
-  unsigned long _msecPlaybackStart;
+  // volume fade in progress, if _msecFade isn't zero
+
+  uint8_t _volumeFadeFrom;
+  uint8_t _volumeFadeTo;
+  unsigned long _msecFadeStart;
+  unsigned long _msecFade;
+
+  // last position read from the VS1053b, and when
+
+  unsigned long _msecPosition;
+  unsigned long _msecPositionUpdate;
+
+  // bytes per second the VS1053b decodes, or zero if it doesn't know yet
+
+  uint16_t _byteRate;
+
+  // Band levels from VLSI's spectrum analyzer plugin, as of the latest
+  // readout by loop(). No bands unless the plugin has been loaded.
+
+  struct Spectrum {
+    uint8_t nBands;
+    uint8_t levels[MUSIC_SPECTRUM_BANDS];
+    unsigned long msecUpdate;
+  };
+
+  Spectrum _spectrum;
+
+  // A sound effect on its way into VLSI's PCM mixer plugin, straight from
+  // RAM or PROGMEM, or from a file through the caller's buffer. Nothing
+  // can be overlaid unless the plugin has been loaded.
+
+  struct Overlay {
+    bool mixer;
+    unsigned char const* bytes;  // samples left to send, 16 bits each
+    size_t nBytes;
+    bool progmem;
+    File* file;                  // refills the buffer once bytes run out
+    unsigned char* buffer;
+    uint16_t nBytesBuffer;
+    uint16_t nWordsFree;         // room in the mixer as of its last read, less what's been sent since
+    uint16_t nWordsSize;         // room in the mixer while empty
+  };
+
+  Overlay _overlay;
+
+  // Once loop() has found nothing to do for _msecPowerDownAfter (unless
+  // that's zero), the VS1053b is left running off XTALI with its analog
+  // side powered down, until something is played or recorded again.
+
+  unsigned long _msecPowerDownAfter;
+  unsigned long _msecIdle;  // when loop() first found nothing to do
+  bool _idle;
+  bool _poweredDown;
+
+#if MUSIC_STATISTICS
+  Statistics _statistics;
+  unsigned long _microsLoopPrev;
+  bool _underrun;
+  unsigned long _microsCancel;
+#endif
 };
 
 
@@ -144,9 +563,12 @@ private:
 
 extern CMusic Music;
 
-static CMusic::State const MUSIC_STATE_IDLE    = CMusic::STATE_IDLE;
-static CMusic::State const MUSIC_STATE_PLAYING = CMusic::STATE_PLAYING;
-static CMusic::State const MUSIC_STATE_BUSY    = CMusic::STATE_BUSY;
+static CMusic::State const MUSIC_STATE_IDLE      = CMusic::STATE_IDLE;
+static CMusic::State const MUSIC_STATE_PLAYING   = CMusic::STATE_PLAYING;
+static CMusic::State const MUSIC_STATE_BUSY      = CMusic::STATE_BUSY;
+static CMusic::State const MUSIC_STATE_RECORDING = CMusic::STATE_RECORDING;
+static CMusic::State const MUSIC_STATE_RESETTING = CMusic::STATE_RESETTING;
+static CMusic::State const MUSIC_STATE_ERROR     = CMusic::STATE_ERROR;
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -157,7 +579,7 @@ static CMusic::State const MUSIC_STATE_BUSY    = CMusic::STATE_BUSY;
 template<size_t SIZE>
 inline bool CMusic::Buffer<SIZE>::active()
 {
-  return (bool) _file;
+  return (_source != SOURCE_NONE);
 }
 
 
@@ -168,26 +590,82 @@ inline bool CMusic::Buffer<SIZE>::active()
 
 inline CMusic::State CMusic::state()
 {
+  if (_reset == RESET_ERROR)
+    return STATE_ERROR;
+
+  if (_reset != RESET_NONE && _reset != RESET_RECORD)
+    return STATE_RESETTING;
+
   if (_cancel || _nBytesFlushRemaining > 0)
     return STATE_BUSY;
 
+  if (_record.file != 0)
+         return (_record.stop ? STATE_BUSY : STATE_RECORDING);
+
   if (_buffer.active())
          return STATE_PLAYING;
     else return STATE_IDLE;
 }
 
 
-inline int CMusic::time()
+inline uint8_t CMusic::queued()
+{
+  return _queueLength;
+}
+
+
+inline bool CMusic::overlaying()
+{
+  return (_overlay.nBytes >= 2 || _overlay.file != 0);
+}
+
+
+inline void CMusic::powerDownAfter(unsigned long msecIdle)
+{
+  _msecPowerDownAfter = msecIdle;
+}
+
+
+inline bool CMusic::poweredDown()
+{
+  return _poweredDown;
+}
+
+
+#if MUSIC_STATISTICS
+
+inline CMusic::Statistics const& CMusic::statistics()
+{
+  return _statistics;
+}
+
+
+inline void CMusic::clearStatistics()
+{
+  _statistics = Statistics();
+}
+
+#endif
+
+
+inline unsigned long CMusic::position()
 {
   if (state() != STATE_PLAYING)
     return 0;
 
-  return (millis() - _msecPlaybackStart) / 1000;
+  return _msecPosition + (millis() - _msecPositionUpdate);
+}
+
+
+inline int CMusic::time()
+{
+  return position() / 1000;
 }
 
 
 inline void CMusic::volume(uint8_t volume)
 {
+  _msecFade = 0;
   _volume = volume;
   updateVolumeAndBalance();
 }
@@ -199,6 +677,18 @@ inline uint8_t CMusic::volume()
 }
 
 
+inline void CMusic::fadeOut(unsigned long msecDuration)
+{
+  fade(0, msecDuration);
+}
+
+
+inline bool CMusic::fading()
+{
+  return (_msecFade != 0);
+}
+
+
 inline void CMusic::balance(int8_t balance)
 {
   _balance = balance;
@@ -16,9 +16,6 @@ void setup()
 
   // initialize SPI communications
   SPI.begin();
-  SPI.setDataMode(SPI_MODE0);
-  SPI.setBitOrder(MSBFIRST);
-  SPI.setClockDivider(SPI_CLOCK_DIV4);
 
   // initialize SD card reader
   SD.begin();
@@ -31,6 +28,10 @@ void setup()
   Music.begin();
   Music.volume(192);
 
+  // let the Music library finish resetting the VS1053b
+  while (Music.state() == MUSIC_STATE_RESETTING)
+    Music.loop();
+
   // start playback!
   Music.play(fileMusic);
 }
@@ -35,9 +35,6 @@ void setup()
 
   // initialize SPI communications
   SPI.begin();
-  SPI.setDataMode(SPI_MODE0);
-  SPI.setBitOrder(MSBFIRST);
-  SPI.setClockDivider(SPI_CLOCK_DIV4);
 
   // initialize SD card reader
   SD.begin();
@@ -102,8 +99,20 @@ void loop()
         Music.cancel();
         break;
 
-      // busy? ignore (should be rather unlikely)
+      // busy or still resetting? ignore (should be rather unlikely)
       case MUSIC_STATE_BUSY:
+      case MUSIC_STATE_RESETTING:
+        break;
+
+      // recording? not from this sketch, but stop it all the same
+      case MUSIC_STATE_RECORDING:
+        Music.cancel();
+        break;
+
+      // VS1053b didn't come back from its reset? then try again
+      case MUSIC_STATE_ERROR:
+        Serial.println(F("VS1053b not responding, resetting..."));
+        Music.reset();
         break;
     }
   } 
@@ -0,0 +1,100 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side stand-in for the Arduino core, backed by the simulator.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  constants
+//
+
+#define HIGH     0x1
+#define LOW      0x0
+
+#define INPUT    0x0
+#define OUTPUT   0x1
+
+#define CHANGE   1
+#define FALLING  2
+#define RISING   3
+
+#define NOT_A_PIN 0
+
+static uint8_t const A0 = 14;
+static uint8_t const A1 = 15;
+static uint8_t const A2 = 16;
+static uint8_t const A3 = 17;
+static uint8_t const A4 = 18;
+static uint8_t const A5 = 19;
+
+#define F(string) (string)
+
+
+// pin change interrupts, mapped like on an ATmega328
+
+extern uint8_t volatile PCICR;
+extern uint8_t volatile PCMSK0;
+extern uint8_t volatile PCMSK1;
+extern uint8_t volatile PCMSK2;
+
+#define digitalPinToPCICR(p)     (((p) <= 21) ? (&PCICR) : ((uint8_t volatile*) 0))
+#define digitalPinToPCICRbit(p)  (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+#define digitalPinToPCMSK(p)     (((p) <= 7) ? (&PCMSK2) : (((p) <= 13) ? (&PCMSK0) : (((p) <= 21) ? (&PCMSK1) : ((uint8_t volatile*) 0))))
+#define digitalPinToPCMSKbit(p)  (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  functions
+//
+
+unsigned long millis();
+unsigned long micros();
+
+void delay(unsigned long msec);
+void delayMicroseconds(unsigned int usec);
+
+void pinMode(uint8_t address, uint8_t mode);
+void digitalWrite(uint8_t address, uint8_t value);
+int digitalRead(uint8_t address);
+
+int analogRead(uint8_t address);
+void analogWrite(uint8_t address, int value);
+
+void noInterrupts();
+void interrupts();
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Stream
+//
+
+class Stream
+{
+public:
+  virtual ~Stream() {}
+
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+
+#endif
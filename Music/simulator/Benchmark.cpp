@@ -0,0 +1,2686 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Benchmark for the Music library, run on the host against the simulator.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <SPI.h>
+#include <SD.h>
+
+#include "Music.h"
+#include "Simulator.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Scenario
+//
+//  Plays one file at a given bit rate, calling Music.loop() and then
+//  spending a given amount of time on other work, over and over again.
+//  Cancels playback after a while if asked to.
+//
+
+SimDecoder Decoder;
+
+
+static void handlePinChange()
+{
+  Music.interrupt();
+}
+
+
+static void awaitReset(CMusic& music)
+{
+  // begin() and reset() leave the rest of the reset to loop()
+
+  while (music.state() == MUSIC_STATE_RESETTING)
+    music.loop();
+}
+
+
+struct Scenario
+{
+  bool          sectors;    // play(Sd2Card&, SdFile&) instead of play(File&)
+  bool          interrupt;  // feed the decoder from the DREQ pin change interrupt too
+  unsigned long kbps;       // bit rate of the file
+  unsigned long msecWork;   // time spent elsewhere between loop() calls
+  unsigned long msecFile;   // length of the file
+  unsigned long msecCancel; // time after which to cancel, or 0 to play to the end
+};
+
+
+struct Result
+{
+  unsigned long nLoops;
+  unsigned long nBytes;
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        msecMarginMin;
+  double        percentBusy;
+  double        msecCancel;
+  unsigned long nBytesOverrun;
+  unsigned long nBytesCollision;
+  unsigned long nSci;
+};
+
+
+static Result run(Scenario const& scenario)
+{
+  Decoder.byteRate = scenario.kbps * 1000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile((uint64_t) Decoder.byteRate * scenario.msecFile / 1000);
+
+  File   file   (simFile);
+  SdFile sdFile (simFile);
+  Sd2Card card;
+
+  if (scenario.interrupt) {
+    Sim.handlerPinChange = handlePinChange;
+    Music.enableInterrupt();
+  }
+  else {
+    Music.disableInterrupt();
+    Sim.handlerPinChange = 0;
+  }
+
+  Decoder.clearStatistics();
+  Music.clearStatistics();
+  Sim.nBytesCollision = 0;
+
+  if (scenario.sectors)
+         Music.play(card, sdFile);
+    else Music.play(file);
+
+  Result result = Result();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosBusy  = 0;
+  uint64_t nanosLimit = nanosStart + (uint64_t) (scenario.msecFile + 10000) * 1000000;
+
+  uint64_t nanosCancel     = 0;
+  uint64_t nanosCancelDone = 0;
+
+  while (Sim.nanos() < nanosLimit) {
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    result.nLoops++;
+
+    if (nanosCancel != 0 && nanosCancelDone == 0 && Music.state() == MUSIC_STATE_IDLE)
+      nanosCancelDone = Sim.nanos();
+
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding())
+      break;
+
+    if (scenario.msecCancel != 0 && nanosCancel == 0
+        && Sim.nanos() - nanosStart >= (uint64_t) scenario.msecCancel * 1000000) {
+      Music.cancel();
+      nanosCancel = Sim.nanos();
+    }
+
+    // other work, plus a microsecond for the sketch's own loop overhead
+    Sim.elapse((uint64_t) scenario.msecWork * 1000000 + 1000);
+  }
+
+  uint64_t nanosTotal = Sim.nanos() - nanosStart;
+
+  result.nBytes          = Decoder.nBytesData;
+  result.nUnderruns      = Decoder.nUnderruns;
+  result.msecUnderrun    = Decoder.nanosUnderrun / 1e6;
+  result.msecMarginMin   = (Decoder.nanosMarginMin == UINT64_MAX ? 0 : Decoder.nanosMarginMin / 1e6);
+  result.percentBusy     = (nanosTotal > 0 ? 100.0 * nanosBusy / nanosTotal : 0);
+  result.msecCancel      = (nanosCancelDone > nanosCancel ? (nanosCancelDone - nanosCancel) / 1e6 : 0);
+  result.nBytesOverrun   = Decoder.nBytesOverrun;
+  result.nBytesCollision = Sim.nBytesCollision;
+  result.nSci            = Decoder.nSciReads + Decoder.nSciWrites;
+
+  // leave the sections after the main matrix to loop() alone
+
+  Music.disableInterrupt();
+  Sim.handlerPinChange = 0;
+
+  return result;
+}
+
+
+static void printStatistics()
+{
+  CMusic::Statistics const& statistics = Music.statistics();
+
+  printf("         statistics: %lu bytes sent, %lu/%lu loops DREQ low/high, %lu underruns,\n"
+         "                     %.1f ms longest loop gap, %lu refills, %.1f ms refilling (%.2f ms longest)\n",
+    (unsigned long) statistics.nBytesSent,
+    (unsigned long) statistics.nLoopsRequestLow,
+    (unsigned long) statistics.nLoopsRequestHigh,
+    (unsigned long) statistics.nUnderruns,
+    statistics.microsLoopGapMax / 1e3,
+    (unsigned long) statistics.nRefills,
+    statistics.microsRefill / 1e3,
+    statistics.microsRefillMax / 1e3);
+}
+
+
+static void print(Scenario const& scenario, Result const& result)
+{
+  printf("%-7s  %4lu  %4lu  %8lu  %8.1f  %5lu  %8.1f  %8.1f  %6.1f  %8.1f  %5lu%s\n",
+    scenario.interrupt ? "irq" : scenario.sectors ? "sectors" : "file",
+    scenario.kbps,
+    scenario.msecWork,
+    result.nLoops,
+    result.nLoops > 0 ? (double) result.nBytes / result.nLoops : 0.0,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.msecMarginMin,
+    result.percentBusy,
+    result.msecCancel,
+    result.nSci,
+    result.nBytesOverrun > 0 || result.nBytesCollision > 0 ? "  (bus errors!)" : "");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Playlist
+//
+//  Queues several files back to back and measures the time the decoder
+//  spends without a stream in between them. Files in the same frame-based
+//  format follow each other gaplessly; files of differing formats are each
+//  flushed before the next one starts.
+//
+
+struct Playlist
+{
+  bool          gapless;    // all files MP3, or alternating with an unknown format
+  unsigned long kbps;
+  unsigned long msecWork;
+  unsigned long msecFile;
+  unsigned long nFiles;
+};
+
+
+struct PlaylistResult
+{
+  unsigned long nStreams;
+  unsigned long nUnderruns;
+  double        msecGap;
+  double        msecTotal;
+};
+
+
+static PlaylistResult run(Playlist const& playlist)
+{
+  Decoder.byteRate = playlist.kbps * 1000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  static size_t const FILES_MAX = 8;
+
+  File files[FILES_MAX];
+
+  for (size_t iFile = 0; iFile < playlist.nFiles && iFile < FILES_MAX; ++iFile) {
+    SimFile* simFile = Sim.createFile((uint64_t) Decoder.byteRate * playlist.msecFile / 1000);
+
+    if (playlist.gapless || iFile % 2 == 0) {
+      simFile->data[0] = 0xFF;  // MPEG 1 Layer III frame sync
+      simFile->data[1] = 0xFB;
+    }
+
+    files[iFile] = File(simFile);
+  }
+
+  Decoder.clearStatistics();
+
+  for (size_t iFile = 0; iFile < playlist.nFiles && iFile < FILES_MAX; ++iFile)
+    Music.queue(files[iFile]);
+
+  PlaylistResult result = PlaylistResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosLimit = nanosStart + (uint64_t) (playlist.msecFile * playlist.nFiles + 10000) * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    Music.loop();
+
+    if (Music.state() == MUSIC_STATE_IDLE && Music.queued() == 0 && !Decoder.decoding())
+      break;
+
+    Sim.elapse((uint64_t) playlist.msecWork * 1000000 + 1000);
+  }
+
+  result.nStreams   = Decoder.nStreams;
+  result.nUnderruns = Decoder.nUnderruns;
+  result.msecGap    = Decoder.nanosGap / 1e6;
+  result.msecTotal  = (Sim.nanos() - nanosStart) / 1e6;
+
+  return result;
+}
+
+
+static void print(Playlist const& playlist, PlaylistResult const& result)
+{
+  printf("%-7s  %4lu  %4lu  %5lu  %7lu  %5lu  %8.1f  %8.1f\n",
+    playlist.gapless ? "gapless" : "mixed",
+    playlist.kbps,
+    playlist.msecWork,
+    playlist.nFiles,
+    result.nStreams,
+    result.nUnderruns,
+    result.msecGap,
+    result.msecTotal);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Jump
+//
+//  Plays a file and jumps by a given time a while into it, either with
+//  seek() or by cancelling, seeking the file and playing it again. Measures
+//  how long it takes until the first byte from the new position is decoded,
+//  and how long the decoder goes without audio in the meantime. Also seeks
+//  in a queued file as soon as the one before it has been read to its end,
+//  while its last bytes are still in the buffer, counting the seek() calls
+//  refused until they're played out.
+//
+
+struct Jump
+{
+  bool          restart;    // cancel() and play() instead of seek()
+  bool          queued;     // seek() into the next file right after it has been appended
+  unsigned long kbps;
+  unsigned long msecWork;
+  long          msecDelta;
+};
+
+
+struct JumpResult
+{
+  double        msecLatency;
+  double        msecSilence;
+  unsigned long nStreams;
+  unsigned long nRefused;
+};
+
+
+static JumpResult run(Jump const& jump)
+{
+  Decoder.byteRate = jump.kbps * 1000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile((uint64_t) Decoder.byteRate * 8);
+
+  simFile->data[0] = 0xFF;  // MPEG 1 Layer III frame sync
+  simFile->data[1] = 0xFB;
+
+  File file(simFile);
+
+  SimFile* simPrevious = Sim.createFile((uint64_t) Decoder.byteRate * 2);
+  simPrevious->data[0] = 0xFF;
+  simPrevious->data[1] = 0xFB;
+
+  File filePrevious(simPrevious);
+
+  Decoder.clearStatistics();
+
+  if (jump.queued) {
+    Music.play(filePrevious);
+    Music.queue(file);
+  }
+  else {
+    Music.play(file);
+  }
+
+  JumpResult result = JumpResult();
+
+  uint64_t nanosStart   = Sim.nanos();
+  uint64_t nanosLimit   = nanosStart + (uint64_t) 10000 * 1000000;
+  uint64_t nanosJump    = 0;
+  uint64_t nanosReached = 0;
+
+  unsigned long nBytesMark = 0;
+  uint32_t positionRestart = 0;
+
+  while (Sim.nanos() < nanosLimit) {
+    Music.loop();
+
+    if (jump.queued) {
+      if (nanosJump == 0 && simPrevious->position == simPrevious->data.size())
+        nanosJump = Sim.nanos();
+
+      if (nanosJump != 0 && nBytesMark == 0) {
+        nBytesMark = Decoder.nBytesData;
+
+        if (!Music.seek(jump.msecDelta)) {
+          nBytesMark = 0;
+          result.nRefused++;
+        }
+      }
+    }
+    else if (nanosJump == 0 && Sim.nanos() - nanosStart >= (uint64_t) 2000 * 1000000) {
+      nanosJump = Sim.nanos();
+
+      if (jump.restart) {
+        positionRestart = file.position() + jump.msecDelta * (long) Decoder.byteRate / 1000;
+        Music.cancel();
+      }
+      else {
+        nBytesMark = Decoder.nBytesData;
+
+        if (!Music.seek(jump.msecDelta))
+          result.nRefused++;
+      }
+    }
+
+    if (positionRestart != 0 && Music.state() == MUSIC_STATE_IDLE) {
+      file.seek(positionRestart);
+      positionRestart = 0;
+
+      nBytesMark = Decoder.nBytesData;
+      Music.play(file);
+    }
+
+    if (nBytesMark != 0 && nanosReached == 0 && Decoder.nBytesTaken > nBytesMark)
+      nanosReached = Sim.nanos();
+
+    if (nanosReached != 0 && Sim.nanos() - nanosReached >= (uint64_t) 500 * 1000000)
+      break;
+
+    Sim.elapse((uint64_t) jump.msecWork * 1000000 + 1000);
+  }
+
+  result.msecLatency = (nanosReached > nanosJump ? (nanosReached - nanosJump) / 1e6 : 0);
+  result.msecSilence = (Decoder.nanosGap + Decoder.nanosUnderrun) / 1e6;
+  result.nStreams    = Decoder.nStreams;
+
+  Music.cancel();
+
+  while (Music.state() != MUSIC_STATE_IDLE) {
+    Music.loop();
+    Sim.elapse(1000);
+  }
+
+  return result;
+}
+
+
+static void print(Jump const& jump, JumpResult const& result)
+{
+  printf("%-7s  %4lu  %4lu  %6ld  %7lu  %10.1f  %10.1f  %7lu\n",
+    jump.restart ? "restart" : jump.queued ? "queued" : "seek",
+    jump.kbps,
+    jump.msecWork,
+    jump.msecDelta,
+    result.nStreams,
+    result.msecLatency,
+    result.msecSilence,
+    result.nRefused);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Stop
+//
+//  Plays a file to its end, or cancels it halfway, with the decoder asking
+//  for an end fill byte other than zero. Measures how long it takes from
+//  the last byte of the file or from cancel() until the library is idle,
+//  and how many bytes it sends in the meantime. A stuck decoder doesn't
+//  clear SM_CANCEL by itself, so the library has to reset it.
+//
+
+enum StopKind
+{
+  STOP_END,
+  STOP_CANCEL,
+  STOP_STUCK,
+};
+
+
+struct Stop
+{
+  StopKind      kind;
+  unsigned long msecWork;
+};
+
+
+struct StopResult
+{
+  double        msecIdle;
+  unsigned long nBytesSent;
+  unsigned long nStreams;
+  unsigned long nResets;
+};
+
+
+static StopResult run(Stop const& stop)
+{
+  static uint16_t const PARAMETRIC_END_FILL_BYTE = 0x1E06;
+
+  Decoder.byteRate = 128000 / 8;
+  Decoder.memory[PARAMETRIC_END_FILL_BYTE] = 0xAA;
+
+  if (stop.kind == STOP_STUCK)
+    Decoder.nBytesCancel = 0xFFFF;
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile(Decoder.byteRate);
+  File file(simFile);
+
+  Decoder.clearStatistics();
+  Music.clearStatistics();
+
+  Music.play(file);
+
+  StopResult result = StopResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosLimit = nanosStart + (uint64_t) 5000 * 1000000;
+  uint64_t nanosStop  = 0;
+
+  unsigned long nBytesStop = 0;
+
+  while (Sim.nanos() < nanosLimit) {
+    Music.loop();
+
+    if (nanosStop == 0) {
+      if (stop.kind == STOP_END
+          ? Decoder.nBytesData >= simFile->data.size()
+          : Sim.nanos() - nanosStart >= (uint64_t) 500 * 1000000) {
+        if (stop.kind != STOP_END)
+          Music.cancel();
+
+        nanosStop  = Sim.nanos();
+        nBytesStop = Decoder.nBytesData;
+      }
+    }
+    else if (Music.state() == MUSIC_STATE_IDLE) {
+      break;
+    }
+
+    Sim.elapse((uint64_t) stop.msecWork * 1000000 + 1000);
+  }
+
+  result.msecIdle   = (nanosStop != 0 ? (Sim.nanos() - nanosStop) / 1e6 : 0);
+  result.nBytesSent = Decoder.nBytesData - nBytesStop;
+  result.nStreams   = Decoder.nStreams;
+  result.nResets    = Music.statistics().nCancelResets;
+
+  Decoder.memory[PARAMETRIC_END_FILL_BYTE] = 0x00;
+  Decoder.nBytesCancel = 512;
+
+  return result;
+}
+
+
+static void print(Stop const& stop, StopResult const& result)
+{
+  static char const* const kinds[] = { "end", "cancel", "stuck" };
+
+  printf("%-7s  %4lu  %7.1f  %6lu  %7lu  %6lu\n",
+    kinds[stop.kind],
+    stop.msecWork,
+    result.msecIdle,
+    result.nBytesSent,
+    result.nStreams,
+    result.nResets);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Zones
+//
+//  Plays a file on each of several decoders on the same bus at once, and
+//  serves them either by calling each one's loop() in turn or by calling
+//  CMusic::loopAll().
+//
+
+static size_t const ZONES_MAX = 3;
+
+SimDecoder DecoderZones[ZONES_MAX - 1];
+CMusic     MusicZones  [ZONES_MAX - 1];
+
+
+static SimDecoder& decoderZone(size_t iZone)
+{
+  return (iZone == 0 ? Decoder : DecoderZones[iZone - 1]);
+}
+
+
+static CMusic& musicZone(size_t iZone)
+{
+  return (iZone == 0 ? Music : MusicZones[iZone - 1]);
+}
+
+
+static void beginZone(size_t iZone)
+{
+  if (iZone == 0) {
+    Music.begin();
+    awaitReset(Music);
+    return;
+  }
+
+  uint8_t addressPinFirst = 2 + 4 * (iZone - 1);
+
+  DecoderZones[iZone - 1].begin(addressPinFirst + 0, addressPinFirst + 1, addressPinFirst + 2, addressPinFirst + 3);
+  MusicZones  [iZone - 1].begin(addressPinFirst + 0, addressPinFirst + 1, addressPinFirst + 2, addressPinFirst + 3);
+
+  awaitReset(MusicZones[iZone - 1]);
+}
+
+
+struct Zones
+{
+  bool          all;        // CMusic::loopAll() instead of each loop()
+  size_t        nZones;
+  unsigned long kbps;
+  unsigned long msecWork;
+};
+
+
+struct ZonesResult
+{
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        msecMarginMin;
+  double        percentBusy;
+};
+
+
+static ZonesResult run(Zones const& zones)
+{
+  File files[ZONES_MAX];
+
+  for (size_t iZone = 0; iZone < zones.nZones; ++iZone) {
+    decoderZone(iZone).byteRate = zones.kbps * 1000 / 8;
+    beginZone(iZone);
+
+    files[iZone] = File(Sim.createFile((uint64_t) zones.kbps * 1000 / 8 * 4));
+
+    decoderZone(iZone).clearStatistics();
+    musicZone(iZone).play(files[iZone]);
+  }
+
+  ZonesResult result = ZonesResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosBusy  = 0;
+  uint64_t nanosLimit = nanosStart + (uint64_t) 14000 * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    uint64_t nanosLoop = Sim.nanos();
+
+    if (zones.all) {
+      CMusic::loopAll();
+    }
+    else {
+      for (size_t iZone = 0; iZone < zones.nZones; ++iZone)
+        musicZone(iZone).loop();
+    }
+
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    bool done = true;
+
+    for (size_t iZone = 0; iZone < zones.nZones; ++iZone) {
+      if (musicZone(iZone).state() != MUSIC_STATE_IDLE || decoderZone(iZone).decoding())
+        done = false;
+    }
+
+    if (done)
+      break;
+
+    Sim.elapse((uint64_t) zones.msecWork * 1000000 + 1000);
+  }
+
+  uint64_t nanosMarginMin = UINT64_MAX;
+
+  for (size_t iZone = 0; iZone < zones.nZones; ++iZone) {
+    SimDecoder& decoder = decoderZone(iZone);
+
+    result.nUnderruns   += decoder.nUnderruns;
+    result.msecUnderrun += decoder.nanosUnderrun / 1e6;
+
+    if (decoder.nanosMarginMin < nanosMarginMin)
+      nanosMarginMin = decoder.nanosMarginMin;
+  }
+
+  result.msecMarginMin = (nanosMarginMin == UINT64_MAX ? 0 : nanosMarginMin / 1e6);
+  result.percentBusy   = 100.0 * nanosBusy / (Sim.nanos() - nanosStart);
+
+  return result;
+}
+
+
+static void print(Zones const& zones, ZonesResult const& result)
+{
+  printf("%-7s  %5lu  %4lu  %4lu  %5lu  %8.1f  %8.1f  %6.1f\n",
+    zones.all ? "loopAll" : "loop",
+    (unsigned long) zones.nZones,
+    zones.kbps,
+    zones.msecWork,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.msecMarginMin,
+    result.percentBusy);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Clip
+//
+//  Triggers a short sound and measures how long it takes until the decoder
+//  gets to decode its first byte, with play(File&), with playClip() and the
+//  clip's head cached in RAM or program memory, or with the whole sound in
+//  RAM or program memory. Counts the blocks read from the SD card, too.
+//
+
+enum ClipSource
+{
+  CLIP_FILE,
+  CLIP_RAM,
+  CLIP_PROGMEM,
+  CLIP_MEMORY_RAM,
+  CLIP_MEMORY_PROGMEM,
+};
+
+
+struct Clip
+{
+  ClipSource    source;
+  unsigned long msecWork;
+};
+
+
+struct ClipResult
+{
+  double        msecLatency;
+  double        msecUnderrun;
+  unsigned long nBlocksRead;
+};
+
+
+static ClipResult run(Clip const& clip)
+{
+  static size_t const nBytesHead = 512;
+
+  Decoder.byteRate = 128000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile(Decoder.byteRate);
+
+  simFile->data[0] = 0xFF;  // MPEG 1 Layer III frame sync
+  simFile->data[1] = 0xFB;
+
+  File file(simFile);
+
+  static unsigned char head[nBytesHead];
+
+  switch (clip.source) {
+    case CLIP_FILE:     break;
+    case CLIP_RAM:      Music.clip(0, file, head, sizeof(head));  break;
+    case CLIP_PROGMEM:  Music.clip_P(0, file, &simFile->data[0], nBytesHead);  break;
+    default:            break;
+  }
+
+  // let the trigger come at some random point between loop() calls
+
+  Music.loop();
+  Sim.elapse((uint64_t) clip.msecWork * 1000000 / 2 + 1000);
+
+  Decoder.clearStatistics();
+
+  ClipResult result = ClipResult();
+
+  uint64_t nanosTrigger = Sim.nanos();
+  uint64_t nanosLimit   = nanosTrigger + (uint64_t) 3000 * 1000000;
+
+  unsigned long nBlocksReadStart = Sim.nBlocksRead;
+
+  switch (clip.source) {
+    case CLIP_FILE:            file.seek(0);  Music.play(file);  break;
+    case CLIP_MEMORY_RAM:      Music.play  (&simFile->data[0], simFile->data.size());  break;
+    case CLIP_MEMORY_PROGMEM:  Music.play_P(&simFile->data[0], simFile->data.size());  break;
+    default:                   Music.playClip(0);  break;
+  }
+
+  while (Sim.nanos() < nanosLimit) {
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding())
+      break;
+
+    Sim.elapse((uint64_t) clip.msecWork * 1000000 + 1000);
+    Music.loop();
+  }
+
+  result.msecLatency  = (Decoder.nStreams > 0 ? (Decoder.nanosStream - nanosTrigger) / 1e6 : 0);
+  result.msecUnderrun = Decoder.nanosUnderrun / 1e6;
+  result.nBlocksRead  = Sim.nBlocksRead - nBlocksReadStart;
+
+  return result;
+}
+
+
+static void print(Clip const& clip, ClipResult const& result)
+{
+  static char const* const sources[] = { "play", "ram", "progmem", "mem", "mem_P" };
+
+  printf("%-7s  %4lu  %10.2f  %6.1f  %6lu\n",
+    sources[clip.source],
+    clip.msecWork,
+    result.msecLatency,
+    result.msecUnderrun,
+    result.nBlocksRead);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Bank
+//
+//  Triggers the last of a given number of short sounds on the card, either
+//  by opening its file by name and calling play(File&), or with playBank()
+//  on a sound bank holding all of them, which is opened beforehand. Either
+//  way, the card holds that many files. Measures how long it takes until
+//  the decoder gets to decode its first byte, and counts the blocks read.
+//
+
+enum BankSource
+{
+  BANK_OPEN,
+  BANK_BANK,
+};
+
+
+struct Bank
+{
+  BankSource source;
+  size_t     nFiles;
+};
+
+
+struct BankResult
+{
+  double        msecLatency;
+  unsigned long nBlocksRead;
+};
+
+
+static void putLittleEndian(std::vector<uint8_t>& data, size_t offset, uint32_t value, size_t nBytes)
+{
+  for (size_t iByte = 0; iByte < nBytes; ++iByte)
+    data[offset + iByte] = (uint8_t) (value >> (8 * iByte));
+}
+
+
+static BankResult run(Bank const& bank)
+{
+  static unsigned long const msecWork = 10;
+
+  Decoder.byteRate = 128000 / 8;
+
+  size_t nBytesClip = Decoder.byteRate / 4;
+
+  Music.begin();
+  awaitReset(Music);
+
+  Sim.formatCard();
+
+  // the sound bank's layout, with every clip starting on a block
+
+  size_t nBytesIndex = 8 + 8 * bank.nFiles;
+  size_t nBytesSlot  = (nBytesClip + 511) / 512 * 512;
+  size_t offsetFirst = (nBytesIndex + 511) / 512 * 512;
+
+  SimFile* simBank = Sim.createFile(offsetFirst + bank.nFiles * nBytesSlot);
+
+  memcpy(&simBank->data[0], "MBNK", 4);
+  putLittleEndian(simBank->data, 4, bank.nFiles, 2);
+  putLittleEndian(simBank->data, 6, 0, 2);
+
+  for (size_t iFile = 0; iFile < bank.nFiles; ++iFile) {
+    size_t offset = offsetFirst + iFile * nBytesSlot;
+
+    putLittleEndian(simBank->data, 8 + 8 * iFile + 0, offset,     4);
+    putLittleEndian(simBank->data, 8 + 8 * iFile + 4, nBytesClip, 4);
+
+    simBank->data[offset + 0] = 0xFF;  // MPEG 1 Layer III frame sync
+    simBank->data[offset + 1] = 0xFB;
+  }
+
+  for (size_t iFile = 0; iFile < bank.nFiles; ++iFile) {
+    SimFile* simFile = Sim.createFile(nBytesClip);
+
+    simFile->data[0] = 0xFF;
+    simFile->data[1] = 0xFB;
+  }
+
+  File fileBank(Sim.openFile(0));
+  File file;
+
+  // let the trigger come at some random point between loop() calls
+
+  Music.loop();
+  Sim.elapse((uint64_t) msecWork * 1000000 / 2 + 1000);
+
+  Decoder.clearStatistics();
+
+  BankResult result = BankResult();
+
+  uint64_t nanosTrigger = Sim.nanos();
+  uint64_t nanosLimit   = nanosTrigger + (uint64_t) 3000 * 1000000;
+
+  unsigned long nBlocksReadStart = Sim.nBlocksRead;
+
+  switch (bank.source) {
+    case BANK_OPEN:  file = File(Sim.openFile(bank.nFiles));  Music.play(file);  break;
+    case BANK_BANK:  Music.playBank(fileBank, bank.nFiles - 1);  break;
+  }
+
+  while (Sim.nanos() < nanosLimit && Decoder.nStreams == 0) {
+    Sim.elapse((uint64_t) msecWork * 1000000 + 1000);
+    Music.loop();
+  }
+
+  result.msecLatency = (Decoder.nStreams > 0 ? (Decoder.nanosStream - nanosTrigger) / 1e6 : 0);
+  result.nBlocksRead = Sim.nBlocksRead - nBlocksReadStart;
+
+  Music.cancel();
+
+  while (Music.state() != MUSIC_STATE_IDLE) {
+    Sim.elapse(1000000);
+    Music.loop();
+  }
+
+  return result;
+}
+
+
+static void print(Bank const& bank, BankResult const& result)
+{
+  static char const* const sources[] = { "open", "bank" };
+
+  printf("%-5s  %5lu  %10.2f  %6lu\n",
+    sources[bank.source],
+    (unsigned long) bank.nFiles,
+    result.msecLatency,
+    result.nBlocksRead);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Power-down
+//
+//  Plays a short file, lets the library sit idle for a few seconds with
+//  loop() still being called, and then triggers a sound with play(File&),
+//  with playClip(), or with reset() and queue(File&). Measures how much of
+//  the idle time the decoder spent powered down, how long the trigger
+//  takes until the decoder gets to decode its first byte, and checks that
+//  the volume is back to what it was.
+//
+
+enum PowerTrigger
+{
+  POWER_PLAY,
+  POWER_CLIP,
+  POWER_RESET,
+};
+
+
+struct Power
+{
+  unsigned long msecPowerDownAfter;
+  PowerTrigger  trigger;
+};
+
+
+struct PowerResult
+{
+  double        percentPowerDown;
+  double        msecLatency;
+  bool          volume;
+  unsigned long nBytesTooFast;
+};
+
+
+static PowerResult run(Power const& power)
+{
+  static uint16_t const SCI_VOL = 0xB;
+
+  static unsigned long const msecWork = 10;
+  static unsigned long const msecIdle = 5000;
+
+  Decoder.byteRate = 128000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+  Music.powerDownAfter(power.msecPowerDownAfter);
+  Music.volume(200);
+
+  uint16_t volume = Decoder.registers[SCI_VOL];
+
+  SimFile* simFile = Sim.createFile(Decoder.byteRate / 2);
+
+  simFile->data[0] = 0xFF;  // MPEG 1 Layer III frame sync
+  simFile->data[1] = 0xFB;
+
+  File file(simFile);
+
+  static unsigned char head[512];
+
+  Music.clip(0, file, head, sizeof(head));
+
+  Decoder.clearStatistics();
+
+  PowerResult result = PowerResult();
+
+  unsigned long nBytesTooFast = 0;
+
+  file.seek(0);
+  Music.play(file);
+
+  uint64_t nanosLimit = Sim.nanos() + (uint64_t) 3000 * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding())
+      break;
+
+    Sim.elapse((uint64_t) msecWork * 1000000 + 1000);
+    Music.loop();
+  }
+
+  nBytesTooFast += Decoder.nBytesTooFast;
+
+  Decoder.clearStatistics();
+
+  uint64_t nanosIdleStart = Sim.nanos();
+
+  while (Sim.nanos() - nanosIdleStart < (uint64_t) msecIdle * 1000000) {
+    Sim.elapse((uint64_t) msecWork * 1000000 + 1000);
+    Music.loop();
+  }
+
+  result.percentPowerDown = 100.0 * Decoder.nanosPowerDown / (Sim.nanos() - nanosIdleStart);
+
+  nBytesTooFast += Decoder.nBytesTooFast;
+
+  // let the trigger come at some random point between loop() calls
+
+  Sim.elapse((uint64_t) msecWork * 1000000 / 2);
+
+  Decoder.clearStatistics();
+
+  uint64_t nanosTrigger = Sim.nanos();
+
+  switch (power.trigger) {
+    case POWER_PLAY:   file.seek(0);  Music.play(file);  break;
+    case POWER_CLIP:   Music.playClip(0);  break;
+    case POWER_RESET:  Music.reset(true, false);  file.seek(0);  Music.queue(file);  break;
+  }
+
+  nanosLimit = nanosTrigger + (uint64_t) 3000 * 1000000;
+
+  while (Sim.nanos() < nanosLimit && Decoder.nStreams == 0) {
+    Sim.elapse((uint64_t) msecWork * 1000000 + 1000);
+    Music.loop();
+  }
+
+  result.msecLatency   = (Decoder.nStreams > 0 ? (Decoder.nanosStream - nanosTrigger) / 1e6 : 0);
+  result.volume        = (Decoder.registers[SCI_VOL] == volume);
+  result.nBytesTooFast = nBytesTooFast + Decoder.nBytesTooFast;
+
+  Music.cancel();
+
+  while (Music.state() != MUSIC_STATE_IDLE) {
+    Sim.elapse(1000000);
+    Music.loop();
+  }
+
+  return result;
+}
+
+
+static void print(Power const& power, PowerResult const& result)
+{
+  static char const* const triggers[] = { "play", "clip", "reset" };
+
+  printf("%-5s  %5lu  %6.1f  %10.2f  %-6s  %8lu\n",
+    triggers[power.trigger],
+    power.msecPowerDownAfter,
+    result.percentPowerDown,
+    result.msecLatency,
+    result.volume ? "ok" : "WRONG",
+    result.nBytesTooFast);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Tags
+//
+//  Plays a file with an ID3v2 tag in front of the audio (a few frames of
+//  text, or cover art on top of that), or ID3v1 and APEv2 tags behind it,
+//  or both with a front tag that doesn't end on a block boundary, through
+//  the SD library or sector by sector. Measures how long it takes until
+//  the decoder gets to the audio, how much of the tags reaches it, and
+//  how many bytes are sent overall.
+//
+
+enum TagKind
+{
+  TAG_NONE,
+  TAG_ID3V2,
+  TAG_ID3V2_ART,
+  TAG_TRAILING,
+  TAG_BOTH,
+};
+
+
+struct Tags
+{
+  TagKind       kind;
+  bool          sectors;    // play(Sd2Card&, SdFile&) instead of play(File&)
+  unsigned long msecWork;
+};
+
+
+struct TagsResult
+{
+  double        msecLatency;
+  unsigned long nBlocksRead;
+  unsigned long nBytesTag;
+  unsigned long nBytesTail;
+  unsigned long nBytesData;
+};
+
+
+static TagsResult run(Tags const& tags)
+{
+  static size_t const nBytesId3v2    = 4096;
+  static size_t const nBytesId3v2Odd = 4097;
+  static size_t const nBytesId3v2Art = 128 * 1024;
+
+  Decoder.byteRate = 128000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  size_t nBytesAudio = Decoder.byteRate * 2;
+  size_t nBytesHead  = 0;
+  size_t nBytesApe   = 0;
+
+  switch (tags.kind) {
+    case TAG_ID3V2:      nBytesHead = nBytesId3v2;                        break;
+    case TAG_ID3V2_ART:  nBytesHead = nBytesId3v2Art;                     break;
+    case TAG_TRAILING:   nBytesApe  = 2048;                               break;
+    case TAG_BOTH:       nBytesHead = nBytesId3v2Odd;  nBytesApe = 8192;  break;
+    default:             break;
+  }
+
+  size_t nBytesTail = (nBytesApe > 0 ? nBytesApe + 128 : 0);
+
+  SimFile* simFile = Sim.createFile(nBytesHead + nBytesAudio + nBytesTail);
+  std::vector<uint8_t>& data = simFile->data;
+
+  if (nBytesHead > 0) {
+    // ID3v2.3 header with a syncsafe size that leaves out the header
+
+    size_t nBytesTag = nBytesHead - 10;
+
+    data[0] = 'I';
+    data[1] = 'D';
+    data[2] = '3';
+    data[3] = 3;
+    data[4] = 0;
+    data[5] = 0;
+    data[6] = (nBytesTag >> 21) & 0x7F;
+    data[7] = (nBytesTag >> 14) & 0x7F;
+    data[8] = (nBytesTag >>  7) & 0x7F;
+    data[9] = (nBytesTag >>  0) & 0x7F;
+  }
+
+  data[nBytesHead + 0] = 0xFF;  // MPEG 1 Layer III frame sync
+  data[nBytesHead + 1] = 0xFB;
+
+  if (nBytesTail > 0) {
+    // APEv2 tag with header and footer, followed by an ID3v1 tag
+
+    size_t offsetApe   = data.size() - nBytesTail;
+    size_t offsetId3v1 = data.size() - 128;
+
+    uint32_t nBytesApeTag = nBytesApe - 32;  // items and footer
+
+    for (int iApe = 0; iApe < 2; ++iApe) {
+      size_t offset = (iApe == 0 ? offsetApe : offsetId3v1 - 32);
+
+      memcpy(&data[offset], "APETAGEX", 8);
+
+      for (int iByte = 0; iByte < 4; ++iByte) {
+        data[offset +  8 + iByte] = (2000         >> (8 * iByte)) & 0xFF;
+        data[offset + 12 + iByte] = (nBytesApeTag >> (8 * iByte)) & 0xFF;
+        data[offset + 16 + iByte] = 0;
+        data[offset + 20 + iByte] = 0;
+      }
+
+      data[offset + 23] = (iApe == 0 ? 0xA0 : 0x80);  // has header, is header
+    }
+
+    memcpy(&data[offsetId3v1], "TAG", 3);
+  }
+
+  File    file   (simFile);
+  SdFile  sdFile (simFile);
+  Sd2Card card;
+
+  // let playback start at some random point between loop() calls
+
+  Music.loop();
+  Sim.elapse((uint64_t) tags.msecWork * 1000000 / 2 + 1000);
+
+  Decoder.clearStatistics();
+
+  TagsResult result = TagsResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosLimit = nanosStart + (uint64_t) 5000 * 1000000;
+
+  unsigned long nBlocksReadStart = Sim.nBlocksRead;
+
+  if (tags.sectors)
+       Music.play(card, sdFile);
+  else Music.play(file);
+
+  while (Sim.nanos() < nanosLimit) {
+    if (Decoder.nStreams > 0 && result.nBlocksRead == 0)
+      result.nBlocksRead = Sim.nBlocksRead - nBlocksReadStart;
+
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding())
+      break;
+
+    Sim.elapse((uint64_t) tags.msecWork * 1000000 + 1000);
+    Music.loop();
+  }
+
+  result.msecLatency = (Decoder.nStreams > 0 ? (Decoder.nanosStream - nanosStart) / 1e6 : 0);
+  result.nBytesTag   = Decoder.nBytesTag;
+  result.nBytesData  = Decoder.nBytesData;
+
+  // how far past the audio the file was read, which all went to the decoder
+
+  uint32_t positionEnd = (tags.sectors ? simFile->positionCard : simFile->position);
+
+  result.nBytesTail = (positionEnd > nBytesHead + nBytesAudio ? positionEnd - (nBytesHead + nBytesAudio) : 0);
+
+  return result;
+}
+
+
+static void print(Tags const& tags, TagsResult const& result)
+{
+  static char const* const kinds[] = { "none", "id3v2", "art", "trailing", "both" };
+
+  printf("%-8s  %-7s  %4lu  %8.2f  %6lu  %6lu  %6lu  %6lu\n",
+    kinds[tags.kind],
+    tags.sectors ? "sectors" : "file",
+    tags.msecWork,
+    result.msecLatency,
+    result.nBlocksRead,
+    result.nBytesTag,
+    result.nBytesTail,
+    result.nBytesData);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Streaming
+//
+//  Plays from a Stream that a sender fills at twice the file's bit rate,
+//  waiting whenever the receive buffer is full, and measures how often
+//  playback runs dry for a given receive buffer size and time spent on
+//  other work between loop() calls.
+//
+
+struct Streaming
+{
+  size_t        nBytesBuffer;  // receive buffer size
+  unsigned long msecWork;
+};
+
+
+struct StreamingResult
+{
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        percentBusy;
+};
+
+
+static StreamingResult run(Streaming const& streaming)
+{
+  Decoder.byteRate = 128000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile(Decoder.byteRate * 3);
+  SimStream stream(*simFile, Decoder.byteRate * 2, streaming.nBytesBuffer);
+
+  Decoder.clearStatistics();
+
+  Music.play(stream);
+
+  StreamingResult result = StreamingResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosBusy  = 0;
+  uint64_t nanosLimit = nanosStart + (uint64_t) 3000 * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    Sim.elapse((uint64_t) streaming.msecWork * 1000000 + 1000);
+  }
+
+  uint64_t nanosTotal = Sim.nanos() - nanosStart;
+
+  result.nUnderruns   = Decoder.nUnderruns;
+  result.msecUnderrun = Decoder.nanosUnderrun / 1e6;
+  result.percentBusy  = 100.0 * nanosBusy / nanosTotal;
+
+  // a stream doesn't end by itself
+
+  Music.cancel();
+
+  while (Music.state() != MUSIC_STATE_IDLE) {
+    Music.loop();
+    Sim.elapse(1000);
+  }
+
+  return result;
+}
+
+
+static void print(Streaming const& streaming, StreamingResult const& result)
+{
+  printf("stream  %6lu  %4lu  %5lu  %8.1f  %6.1f\n",
+    (unsigned long) streaming.nBytesBuffer,
+    streaming.msecWork,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.percentBusy);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Position
+//
+//  Plays a file and compares position() against how much the decoder has
+//  actually played whenever loop() returns, with the decoder reporting
+//  positionMsec or only SCI_DECODE_TIME.
+//
+
+struct Position
+{
+  bool          positionMsec;
+  unsigned long kbps;
+  unsigned long msecWork;
+};
+
+
+struct PositionResult
+{
+  double msecErrorMax;
+  double msecErrorMean;
+  double nSciPerSecond;
+};
+
+
+static PositionResult run(Position const& position)
+{
+  Decoder.byteRate     = position.kbps * 1000 / 8;
+  Decoder.positionMsec = position.positionMsec;
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile((uint64_t) Decoder.byteRate * 6);
+  File file(simFile);
+
+  Decoder.clearStatistics();
+  Music.play(file);
+
+  PositionResult result = PositionResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosEnd   = nanosStart + (uint64_t) 5500 * 1000000;
+
+  unsigned long nSamples = 0;
+  double msecErrorTotal = 0;
+
+  while (Sim.nanos() < nanosEnd) {
+    Music.loop();
+
+    if (Sim.nanos() - nanosStart >= (uint64_t) 500 * 1000000) {
+      double msecError = fabs((double) Music.position() - (double) Decoder.msecDecoded());
+
+      if (msecError > result.msecErrorMax)
+        result.msecErrorMax = msecError;
+
+      msecErrorTotal += msecError;
+      nSamples++;
+    }
+
+    Sim.elapse((uint64_t) position.msecWork * 1000000 + 1000);
+  }
+
+  result.msecErrorMean = (nSamples > 0 ? msecErrorTotal / nSamples : 0);
+  result.nSciPerSecond = (Decoder.nSciReads + Decoder.nSciWrites) / ((Sim.nanos() - nanosStart) / 1e9);
+
+  Music.cancel();
+
+  while (Music.state() != MUSIC_STATE_IDLE) {
+    Music.loop();
+    Sim.elapse(1000);
+  }
+
+  Decoder.positionMsec = false;
+
+  return result;
+}
+
+
+static void print(Position const& position, PositionResult const& result)
+{
+  printf("%-7s  %4lu  %4lu  %9.1f  %10.1f  %7.1f\n",
+    position.positionMsec ? "msec" : "seconds",
+    position.kbps,
+    position.msecWork,
+    result.msecErrorMax,
+    result.msecErrorMean,
+    result.nSciPerSecond);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Fade
+//
+//  Fades out over two seconds while playing, either with fadeOut() or by
+//  having the sketch work out the volume itself and call volume() after
+//  every loop(). Counts writes to SCI_VOL, finds the largest single step
+//  in attenuation, and measures how late the fade reached silence.
+//
+
+struct Fade
+{
+  bool          sketch;     // volume() after every loop() instead of fadeOut()
+  unsigned long msecWork;
+};
+
+
+struct FadeResult
+{
+  unsigned long nVolumeWrites;
+  double        dbStepMax;
+  double        msecLate;
+  unsigned long nUnderruns;
+};
+
+
+static FadeResult run(Fade const& fade)
+{
+  static unsigned long const msecFade = 2000;
+
+  Decoder.byteRate = 128000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  File file(Sim.createFile(Decoder.byteRate * 4));
+
+  Music.play(file);
+
+  Decoder.clearStatistics();
+
+  FadeResult result = FadeResult();
+
+  unsigned long msecStart = millis();
+
+  if (!fade.sketch)
+    Music.fadeOut(msecFade);
+
+  uint64_t nanosSilent = 0;
+  uint64_t nanosLimit  = Sim.nanos() + (uint64_t) (msecFade + 500) * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    Music.loop();
+
+    if (fade.sketch) {
+      unsigned long msecElapsed = millis() - msecStart;
+      Music.volume(msecElapsed < msecFade ? 255 - 255 * msecElapsed / msecFade : 0);
+    }
+
+    if (nanosSilent == 0 && Music.volume() == 0)
+      nanosSilent = Sim.nanos();
+
+    Sim.elapse((uint64_t) fade.msecWork * 1000000 + 1000);
+  }
+
+  result.nVolumeWrites = Decoder.nVolumeWrites;
+  result.dbStepMax     = Decoder.volumeStepMax / 2.0;
+  result.msecLate      = (nanosSilent != 0 ? nanosSilent / 1e6 - msecStart - msecFade : 0);
+  result.nUnderruns    = Decoder.nUnderruns;
+
+  Music.cancel();
+
+  while (Music.state() != MUSIC_STATE_IDLE) {
+    Music.loop();
+    Sim.elapse(1000);
+  }
+
+  Music.volume(255);
+
+  return result;
+}
+
+
+static void print(Fade const& fade, FadeResult const& result)
+{
+  printf("%-7s  %4lu  %6lu  %7.1f  %7.1f  %5lu\n",
+    fade.sketch ? "volume" : "fade",
+    fade.msecWork,
+    result.nVolumeWrites,
+    result.dbStepMax,
+    result.msecLate,
+    result.nUnderruns);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Recording
+//
+//  Records for a while at a given sample rate into a buffer of one or two
+//  blocks, calling Music.loop() and spending a given amount of time on
+//  other work in between, then stops. Measures the bit rate that made it
+//  to the file, how much the encoder had to drop because its buffer was
+//  full, and checks that the file holds every word that was read from the
+//  encoder, in order, behind a header that matches its length. Any words
+//  dropped by the encoder count as a failure, too.
+//
+
+struct Recording
+{
+  unsigned long sampleRate;
+  size_t        nBlocks;    // size of the buffer in 512-byte blocks
+  unsigned long msecWork;
+};
+
+
+struct RecordingResult
+{
+  double        kbps;
+  unsigned long nWordsLost;
+  double        msecBacklogMax;
+  double        msecWriteMax;
+  double        percentBusy;
+  bool          success;
+};
+
+
+static RecordingResult run(Recording const& recording)
+{
+  static unsigned char buffer[2 * 512];
+
+  Music.begin();
+  awaitReset(Music);
+
+  SimFile* simFile = Sim.createFile(0);
+  File file(simFile);
+
+  Decoder.clearStatistics();
+  Music.clearStatistics();
+
+  RecordingResult result = RecordingResult();
+
+  result.success = Music.record(file, buffer, recording.nBlocks * 512, recording.sampleRate);
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosStop  = nanosStart + (uint64_t) 12000 * 1000000;
+  uint64_t nanosBusy  = 0;
+
+  while (result.success) {
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    if (Music.state() == MUSIC_STATE_IDLE)
+      break;
+
+    if (Music.state() == MUSIC_STATE_RECORDING && Sim.nanos() >= nanosStop)
+      Music.cancel();
+
+    Sim.elapse((uint64_t) recording.msecWork * 1000000 + 1000);
+  }
+
+  double secTotal = (Sim.nanos() - nanosStart) / 1e9;
+
+  std::vector<uint8_t> const& data = simFile->data;
+
+  uint32_t nBytesData = (data.size() >= 60 ? data[56] | data[57] << 8 | data[58] << 16 | data[59] << 24 : 0);
+
+  if (data.size() < 60 || memcmp(&data[0], "RIFF", 4) != 0 || nBytesData != data.size() - 60)
+    result.success = false;
+
+  for (size_t iByte = 60; iByte + 1 < data.size(); iByte += 2) {
+    uint16_t value = (uint16_t) (data[iByte] << 8 | data[iByte + 1]);
+
+    if (value != (uint16_t) ((iByte - 60) / 2))
+      result.success = false;
+  }
+
+  if (data.size() - 60 != 2 * Decoder.nWordsRead || Decoder.recording())
+    result.success = false;
+
+  double wordRate = recording.sampleRate * 128.0 / 505;
+
+  result.kbps           = (secTotal > 0 ? nBytesData * 8 / secTotal / 1000 : 0);
+  result.nWordsLost     = Decoder.nWordsLost;
+  result.msecBacklogMax = Decoder.nWordsBacklogMax * 1000 / wordRate;
+  result.msecWriteMax   = Music.statistics().microsWriteMax / 1e3;
+  result.percentBusy    = (secTotal > 0 ? 100.0 * nanosBusy / 1e9 / secTotal : 0);
+
+  return result;
+}
+
+
+static void print(Recording const& recording, RecordingResult const& result)
+{
+  printf("%-6s  %5lu  %4lu  %6.1f  %6lu  %10.1f  %8.1f  %6.1f  %s\n",
+    recording.nBlocks > 1 ? "double" : "single",
+    recording.sampleRate,
+    recording.msecWork,
+    result.kbps,
+    result.nWordsLost,
+    result.msecBacklogMax,
+    result.msecWriteMax,
+    result.percentBusy,
+    !result.success ? "FAILED" : result.nWordsLost > 0 ? "LOST" : "ok");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Plugin
+//
+//  Loads a made-up plugin of about the size of VLSI's VS1053b patches,
+//  either from program memory or from a file, and checks that it ended up
+//  in the decoder's memory. The per-word variant sets SCI_WRAMADDR for
+//  every single word, like Memory bindings do, instead of writing blocks
+//  of words to SCI_WRAM in one go.
+//
+
+struct Plugin
+{
+  bool perWord;
+  bool file;
+};
+
+
+struct PluginResult
+{
+  unsigned long nWords;
+  unsigned long nSci;
+  unsigned long nSciEarly;
+  double        msecLoad;
+  bool          success;
+};
+
+
+static PluginResult run(Plugin const& plugin)
+{
+  static uint16_t const SCI_WRAM     = 0x6;
+  static uint16_t const SCI_WRAMADDR = 0x7;
+  static uint16_t const SCI_AIADDR   = 0xA;
+
+  std::vector<uint16_t> words;
+  std::vector<uint16_t> expected(0x10000, 0);
+
+  for (uint16_t iBlock = 0; iBlock < 8; ++iBlock) {
+    uint16_t address = 0x0800 + iBlock * 0x200;
+
+    if (plugin.perWord) {
+      for (uint16_t iWord = 0; iWord < 500; ++iWord) {
+        words.push_back(SCI_WRAMADDR);  words.push_back(1);  words.push_back(address + iWord);
+        words.push_back(SCI_WRAM);      words.push_back(1);  words.push_back(iBlock * 1000 + iWord);
+      }
+    }
+    else {
+      words.push_back(SCI_WRAMADDR);  words.push_back(1);  words.push_back(address);
+      words.push_back(SCI_WRAM);      words.push_back(500);
+
+      for (uint16_t iWord = 0; iWord < 500; ++iWord)
+        words.push_back(iBlock * 1000 + iWord);
+    }
+
+    for (uint16_t iWord = 0; iWord < 500; ++iWord)
+      expected[address + iWord] = iBlock * 1000 + iWord;
+  }
+
+  // a run of zeros, and starting the plugin
+
+  words.push_back(SCI_WRAMADDR);  words.push_back(1);               words.push_back(0x1800);
+  words.push_back(SCI_WRAM);      words.push_back(0x8000 | 0x100);  words.push_back(0x0000);
+  words.push_back(SCI_AIADDR);    words.push_back(1);               words.push_back(0x0050);
+
+  Music.begin();
+  awaitReset(Music);
+
+  for (size_t iAddress = 0; iAddress < Decoder.memory.size(); ++iAddress)
+    Decoder.memory[iAddress] = 0xFFFF;
+
+  for (uint16_t iWord = 0; iWord < 0x100; ++iWord)
+    expected[0x1800 + iWord] = 0x0000;
+
+  SimFile* simFile = Sim.createFile(words.size() * 2);
+
+  for (size_t iWord = 0; iWord < words.size(); ++iWord) {
+    simFile->data[iWord * 2 + 0] = (uint8_t) (words[iWord] >> 0);
+    simFile->data[iWord * 2 + 1] = (uint8_t) (words[iWord] >> 8);
+  }
+
+  File file(simFile);
+
+  Decoder.clearStatistics();
+  Sim.nBytesCollision = 0;
+
+  PluginResult result = PluginResult();
+
+  uint64_t nanosStart = Sim.nanos();
+
+  result.success = (plugin.file
+    ? Music.load(file)
+    : Music.load(&words[0], words.size()));
+
+  result.msecLoad  = (Sim.nanos() - nanosStart) / 1e6;
+  result.nWords    = words.size();
+  result.nSci      = Decoder.nSciReads + Decoder.nSciWrites;
+  result.nSciEarly = Decoder.nSciEarly;
+
+  for (size_t iAddress = 0; iAddress < expected.size(); ++iAddress) {
+    if (expected[iAddress] != 0 || iAddress - 0x1800 < 0x100) {
+      if (Decoder.memory[iAddress] != expected[iAddress])
+        result.success = false;
+    }
+  }
+
+  if (Decoder.registers[SCI_AIADDR] != 0x0050 || Sim.nBytesCollision > 0)
+    result.success = false;
+
+  return result;
+}
+
+
+static void print(Plugin const& plugin, PluginResult const& result)
+{
+  printf("%-8s  %-6s  %6lu  %6lu  %5lu  %8.1f  %s\n",
+    plugin.perWord ? "per-word" : "burst",
+    plugin.file ? "file" : "flash",
+    result.nWords,
+    result.nSci,
+    result.nSciEarly,
+    result.msecLoad,
+    result.success ? "ok" : "FAILED");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Spectrum
+//
+//  Plays a file with or without the spectrum analyzer readout, from a
+//  stand-in for VLSI's plugin that only sets up its bands. The bands'
+//  levels are changed before every loop(), to count how many readouts
+//  make it to spectrum() per second, and how many SCI transactions that
+//  takes.
+//
+
+struct Spectrum
+{
+  bool          spectrum;
+  unsigned long kbps;
+  unsigned long msecWork;
+};
+
+
+struct SpectrumResult
+{
+  double        nFramesPerSecond;
+  double        nSciPerSecond;
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        percentBusy;
+};
+
+
+static SpectrumResult run(Spectrum const& spectrum)
+{
+  static uint16_t const SCI_WRAM     = 0x6;
+  static uint16_t const SCI_WRAMADDR = 0x7;
+
+  static uint16_t const nBands = 14;
+
+  std::vector<uint16_t> words;
+
+  words.push_back(SCI_WRAMADDR);  words.push_back(1);           words.push_back(0x1802);
+  words.push_back(SCI_WRAM);      words.push_back(1);           words.push_back(nBands);
+  words.push_back(SCI_WRAMADDR);  words.push_back(1);           words.push_back(0x1804);
+  words.push_back(SCI_WRAM);      words.push_back(0x8000 | nBands);  words.push_back(0x0000);
+
+  Decoder.byteRate = spectrum.kbps * 1000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+
+  if (spectrum.spectrum)
+    Music.loadSpectrum(&words[0], words.size());
+
+  File file(Sim.createFile(Decoder.byteRate * 5));
+
+  Decoder.clearStatistics();
+
+  Music.play(file);
+
+  SpectrumResult result = SpectrumResult();
+
+  unsigned long nFrames = 0;
+  uint8_t levelPrev = 0;
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosBusy  = 0;
+  uint64_t nanosLimit = nanosStart + (uint64_t) 10000 * 1000000;
+
+  for (uint16_t iFrame = 1; Sim.nanos() < nanosLimit; ++iFrame) {
+    for (uint16_t iBand = 0; iBand < nBands; ++iBand)
+      Decoder.memory[0x1804 + iBand] = (uint16_t) (iFrame + iBand) % 63 + 1;
+
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding())
+      break;
+
+    uint8_t levels[nBands];
+
+    if (Music.spectrum(levels, nBands) == nBands && levels[0] != levelPrev) {
+      bool match = true;
+
+      for (uint16_t iBand = 1; iBand < nBands; ++iBand) {
+        if (levels[iBand] != (levels[0] - 1 + iBand) % 63 + 1)
+          match = false;
+      }
+
+      if (match)
+        ++nFrames;
+
+      levelPrev = levels[0];
+    }
+
+    Sim.elapse((uint64_t) spectrum.msecWork * 1000000 + 1000);
+  }
+
+  uint64_t nanosTotal = Sim.nanos() - nanosStart;
+
+  result.nFramesPerSecond = (nanosTotal > 0 ? nFrames * 1e9 / nanosTotal : 0);
+  result.nSciPerSecond    = (nanosTotal > 0 ? (Decoder.nSciReads + Decoder.nSciWrites) * 1e9 / nanosTotal : 0);
+  result.nUnderruns       = Decoder.nUnderruns;
+  result.msecUnderrun     = Decoder.nanosUnderrun / 1e6;
+  result.percentBusy      = (nanosTotal > 0 ? 100.0 * nanosBusy / nanosTotal : 0);
+
+  return result;
+}
+
+
+static void print(Spectrum const& spectrum, SpectrumResult const& result)
+{
+  printf("%-8s  %4lu  %4lu  %8.1f  %5.0f  %5lu  %8.1f  %6.1f\n",
+    spectrum.spectrum ? "spectrum" : "off",
+    spectrum.kbps,
+    spectrum.msecWork,
+    result.nFramesPerSecond,
+    result.nSciPerSecond,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.percentBusy);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Overlay
+//
+//  Plays a file and, a second into it, overlays a half-second sound effect
+//  through a stand-in for VLSI's PCM mixer plugin, from RAM, from program
+//  memory, or from a file through a 512-byte buffer, with or without the
+//  interrupt keeping the decoder's buffer full. Measures how long the
+//  mixer went without samples in the middle of the effect, and whether
+//  the music underran meanwhile.
+//
+
+enum OverlaySource
+{
+  OVERLAY_NONE,
+  OVERLAY_RAM,
+  OVERLAY_PROGMEM,
+  OVERLAY_FILE,
+};
+
+
+struct Overlay
+{
+  OverlaySource source;
+  bool          interrupt;  // feed the decoder from the DREQ pin change interrupt too
+  unsigned long kbps;
+  unsigned long msecWork;
+};
+
+
+struct OverlayResult
+{
+  unsigned long nSamples;
+  double        msecMixerDry;
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        percentBusy;
+};
+
+
+// the rate the library was built to expect from the mixer
+
+static unsigned long const mixerRate = MUSIC_MIXER_RATE;
+
+
+static void loadMixer()
+{
+  static uint16_t const SCI_AIADDR = 0xA;
+
+  uint16_t const words[] = { SCI_AIADDR, 1, 0x0D00 };
+
+  Decoder.mixerRate = mixerRate;
+
+  Music.loadMixer(words, sizeof(words) / sizeof(*words));
+}
+
+
+static double msecMixerDry()
+{
+  // how much longer the mixer took to get through its samples than it
+  // would have without ever running dry
+
+  uint64_t nanosSamples = (uint64_t) Decoder.nMixerSamples * 1000000000 / mixerRate;
+  uint64_t nanosMixer   = Decoder.nanosMixerEmpty - Decoder.nanosMixerFirst;
+
+  return (Decoder.nMixerSamples > 0 && nanosMixer > nanosSamples ? (nanosMixer - nanosSamples) / 1e6 : 0);
+}
+
+
+static OverlayResult run(Overlay const& overlay)
+{
+  Decoder.byteRate = overlay.kbps * 1000 / 8;
+
+  Music.begin();
+  awaitReset(Music);
+  loadMixer();
+
+  File file(Sim.createFile(Decoder.byteRate * 3));
+
+  SimFile* simEffect = Sim.createFile(mixerRate / 2 * 2);
+  File fileEffect(simEffect);
+
+  static unsigned char buffer[512];
+
+  if (overlay.interrupt) {
+    Sim.handlerPinChange = handlePinChange;
+    Music.enableInterrupt();
+  }
+
+  Music.play(file);
+
+  Decoder.clearStatistics();
+
+  OverlayResult result = OverlayResult();
+
+  uint64_t nanosStart   = Sim.nanos();
+  uint64_t nanosTrigger = nanosStart + (uint64_t) 1000 * 1000000;
+  uint64_t nanosLimit   = nanosStart + (uint64_t) 5000 * 1000000;
+  uint64_t nanosBusy    = 0;
+
+  bool triggered = false;
+
+  while (Sim.nanos() < nanosLimit) {
+    if (!triggered && Sim.nanos() >= nanosTrigger) {
+      switch (overlay.source) {
+        case OVERLAY_NONE:     break;
+        case OVERLAY_RAM:      Music.overlay  (&simEffect->data[0], simEffect->data.size());  break;
+        case OVERLAY_PROGMEM:  Music.overlay_P(&simEffect->data[0], simEffect->data.size());  break;
+        case OVERLAY_FILE:     Music.overlay(fileEffect, buffer, sizeof(buffer));  break;
+      }
+
+      triggered = true;
+    }
+
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding() && !Music.overlaying())
+      break;
+
+    Sim.elapse((uint64_t) overlay.msecWork * 1000000 + 1000);
+  }
+
+  uint64_t nanosTotal = Sim.nanos() - nanosStart;
+
+  result.nSamples     = Decoder.nMixerSamples;
+  result.msecMixerDry = msecMixerDry();
+  result.nUnderruns   = Decoder.nUnderruns;
+  result.msecUnderrun = Decoder.nanosUnderrun / 1e6;
+  result.percentBusy  = (nanosTotal > 0 ? 100.0 * nanosBusy / nanosTotal : 0);
+
+  Decoder.mixerRate = 0;
+
+  Music.disableInterrupt();
+  Sim.handlerPinChange = 0;
+
+  return result;
+}
+
+
+static void print(Overlay const& overlay, OverlayResult const& result)
+{
+  static char const* const sources[] = { "none", "ram", "progmem", "file" };
+
+  printf("%-8s  %-4s  %4lu  %4lu  %7lu  %8.1f  %5lu  %8.1f  %6.1f\n",
+    sources[overlay.source],
+    overlay.interrupt ? "irq" : "loop",
+    overlay.kbps,
+    overlay.msecWork,
+    result.nSamples,
+    result.msecMixerDry,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.percentBusy);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Reset
+//
+//  Resets the decoder with reset() or reset(false) and calls Music.loop()
+//  every given number of milliseconds until it's done, as a sketch with
+//  other things to keep up with would, optionally with a decoder that
+//  never raises DREQ, and that's powered down to begin with, so that the
+//  reset has to switch its clock first. Measures how long that takes, and
+//  the longest time any single call of reset() or loop() took meanwhile.
+//
+
+struct Reset
+{
+  bool          hardware;
+  bool          hung;
+  bool          asleep;
+  unsigned long msecWork;
+};
+
+
+struct ResetResult
+{
+  double        msecReady;
+  double        msecCallMax;
+  CMusic::State state;
+};
+
+
+static ResetResult run(Reset const& reset)
+{
+  Music.begin();
+  awaitReset(Music);
+
+  if (reset.asleep) {
+    Music.powerDownAfter(1);
+
+    while (!Music.poweredDown()) {
+      Sim.elapse(1000000);
+      Music.loop();
+    }
+
+    Music.powerDownAfter(0);
+  }
+
+  Decoder.hung = reset.hung;
+
+  ResetResult result = ResetResult();
+
+  uint64_t nanosStart   = Sim.nanos();
+  uint64_t nanosLimit   = nanosStart + (uint64_t) 1000 * 1000000;
+  uint64_t nanosCallMax = 0;
+
+  Music.reset(reset.hardware);
+  nanosCallMax = Sim.nanos() - nanosStart;
+
+  while (Sim.nanos() < nanosLimit && Music.state() == MUSIC_STATE_RESETTING) {
+    Sim.elapse((uint64_t) reset.msecWork * 1000000 + 1000);
+
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+
+    if (Sim.nanos() - nanosLoop > nanosCallMax)
+      nanosCallMax = Sim.nanos() - nanosLoop;
+  }
+
+  result.msecReady   = (Sim.nanos() - nanosStart) / 1e6;
+  result.msecCallMax = nanosCallMax / 1e6;
+  result.state       = Music.state();
+
+  Decoder.hung = false;
+
+  Music.begin();
+  awaitReset(Music);
+
+  return result;
+}
+
+
+static void print(Reset const& reset, ResetResult const& result)
+{
+  printf("%-8s  %-6s  %4lu  %8.2f  %7.3f  %s\n",
+    reset.hardware ? "hardware" : "software",
+    reset.asleep ? "asleep" : reset.hung ? "hung" : "ok",
+    reset.msecWork,
+    result.msecReady,
+    result.msecCallMax,
+    result.state == MUSIC_STATE_IDLE ? "idle" : result.state == MUSIC_STATE_ERROR ? "error" : "resetting");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Deadline
+//
+//  Plays a file while the sketch has jobs of a fixed length to get done,
+//  either running one after every loop() regardless, or only when
+//  deadline() says there's time for it (and calling loop() again after a
+//  millisecond otherwise), optionally with a sound effect overlaid for
+//  most of the file. Counts the jobs done per second and underruns, and
+//  how long the mixer went without samples.
+//
+
+struct Deadline
+{
+  bool          deadline;
+  bool          overlay;
+  unsigned long kbps;
+  unsigned long msecJob;
+};
+
+
+struct DeadlineResult
+{
+  double        nJobsPerSecond;
+  double        msecMixerDry;
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        percentBusy;
+};
+
+
+static DeadlineResult run(Deadline const& deadline)
+{
+  Decoder.byteRate = deadline.kbps * 1000 / 8;
+  Decoder.clearStatistics();
+
+  Music.begin();
+  awaitReset(Music);
+
+  if (deadline.overlay)
+    loadMixer();
+
+  File file(Sim.createFile(Decoder.byteRate * 5));
+
+  Music.play(file);
+
+  // four seconds' worth, over most of the five-second file
+
+  SimFile* simEffect = Sim.createFile(mixerRate * 4 * 2);
+
+  if (deadline.overlay)
+    Music.overlay(&simEffect->data[0], simEffect->data.size());
+
+  DeadlineResult result = DeadlineResult();
+
+  unsigned long nJobs = 0;
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosBusy  = 0;
+  uint64_t nanosLimit = nanosStart + (uint64_t) 10000 * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding() && !Music.overlaying())
+      break;
+
+    if (!deadline.deadline || Music.deadline() >= deadline.msecJob) {
+      Sim.elapse((uint64_t) deadline.msecJob * 1000000);
+      ++nJobs;
+    }
+    else {
+      Sim.elapse(1000000);
+    }
+  }
+
+  uint64_t nanosTotal = Sim.nanos() - nanosStart;
+
+  result.nJobsPerSecond = (nanosTotal > 0 ? nJobs * 1e9 / nanosTotal : 0);
+  result.msecMixerDry   = msecMixerDry();
+  result.nUnderruns     = Decoder.nUnderruns;
+  result.msecUnderrun   = Decoder.nanosUnderrun / 1e6;
+  result.percentBusy    = (nanosTotal > 0 ? 100.0 * nanosBusy / nanosTotal : 0);
+
+  Decoder.mixerRate = 0;
+
+  return result;
+}
+
+
+static void print(Deadline const& deadline, DeadlineResult const& result)
+{
+  printf("%-8s  %-7s  %4lu  %4lu  %6.1f  %8.1f  %5lu  %8.1f  %6.1f\n",
+    deadline.deadline ? "deadline" : "blind",
+    deadline.overlay ? "overlay" : "-",
+    deadline.kbps,
+    deadline.msecJob,
+    result.nJobsPerSecond,
+    result.msecMixerDry,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.percentBusy);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Bus
+//
+//  Plays one file while another device on the bus leaves the SPI clock at
+//  a given divider after every loop(), from the first hardware reset on.
+//  Counts underruns, and bytes clocked faster than the VS1053b allows.
+//
+
+struct Bus
+{
+  uint8_t       divider;    // SPI_CLOCK_DIV2 and so on
+  unsigned long kbps;
+  unsigned long msecWork;
+};
+
+
+struct BusResult
+{
+  unsigned long nUnderruns;
+  double        msecUnderrun;
+  double        percentBusy;
+  unsigned long nBytesTooFast;
+};
+
+
+static BusResult run(Bus const& bus)
+{
+  Decoder.byteRate = bus.kbps * 1000 / 8;
+  Decoder.clearStatistics();
+
+  SPI.setClockDivider(bus.divider);
+
+  Music.begin();
+  awaitReset(Music);
+
+  File file(Sim.createFile(Decoder.byteRate * 3));
+
+  Music.play(file);
+
+  BusResult result = BusResult();
+
+  uint64_t nanosStart = Sim.nanos();
+  uint64_t nanosBusy  = 0;
+  uint64_t nanosLimit = nanosStart + (uint64_t) 10000 * 1000000;
+
+  while (Sim.nanos() < nanosLimit) {
+    uint64_t nanosLoop = Sim.nanos();
+    Music.loop();
+    nanosBusy += Sim.nanos() - nanosLoop;
+
+    if (Music.state() == MUSIC_STATE_IDLE && !Decoder.decoding())
+      break;
+
+    SPI.setClockDivider(bus.divider);
+
+    Sim.elapse((uint64_t) bus.msecWork * 1000000 + 1000);
+  }
+
+  uint64_t nanosTotal = Sim.nanos() - nanosStart;
+
+  result.nUnderruns    = Decoder.nUnderruns;
+  result.msecUnderrun  = Decoder.nanosUnderrun / 1e6;
+  result.percentBusy   = (nanosTotal > 0 ? 100.0 * nanosBusy / nanosTotal : 0);
+  result.nBytesTooFast = Decoder.nBytesTooFast;
+
+  SPI.setClockDivider(SPI_CLOCK_DIV4);
+
+  return result;
+}
+
+
+static void print(Bus const& bus, BusResult const& result)
+{
+  static char const* const names[8] = { "div4", "div16", "div64", "div128", "div2", "div8", "div32", "?" };
+
+  printf("%-7s  %4lu  %4lu  %5lu  %8.1f  %6.1f  %8lu\n",
+    names[bus.divider & 0x7],
+    bus.kbps,
+    bus.msecWork,
+    result.nUnderruns,
+    result.msecUnderrun,
+    result.percentBusy,
+    result.nBytesTooFast);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  main
+//
+//  Usage: benchmark [kbps [msecWork [msecCancel]]]
+//
+//  Without arguments, runs a matrix of bit rates and loop() call intervals
+//  for File playback, raw-sector playback, and File playback with the DREQ
+//  interrupt enabled.
+//
+
+int main(int argc, char** argv)
+{
+  SPI.begin();
+  SPI.setClockDivider(SPI_CLOCK_DIV4);
+
+  Decoder.begin();
+
+  printf("Music library benchmark, MUSIC_BUFFER_SIZE = %u\n\n", (unsigned) MUSIC_BUFFER_SIZE);
+  printf("source   kbps  work     loops  B/loop  under   dry/ms  margin/ms  busy/%%  cancel/ms    sci\n");
+
+  if (argc > 1) {
+    Scenario scenario = Scenario();
+
+    scenario.kbps       = strtoul(argv[1], 0, 10);
+    scenario.msecWork   = (argc > 2 ? strtoul(argv[2], 0, 10) : 0);
+    scenario.msecCancel = (argc > 3 ? strtoul(argv[3], 0, 10) : 0);
+    scenario.msecFile   = 10000;
+
+    for (int iSource = 0; iSource < 3; ++iSource) {
+      scenario.sectors   = (iSource == 1);
+      scenario.interrupt = (iSource == 2);
+      print(scenario, run(scenario));
+      printStatistics();
+    }
+
+    return 0;
+  }
+
+  static unsigned long const kbpsAll[]     = { 128, 192, 320 };
+  static unsigned long const msecWorkAll[] = { 0, 10, 50, 80, 100, 120 };
+
+  for (int iSource = 0; iSource < 3; ++iSource) {
+    for (size_t iKbps = 0; iKbps < sizeof(kbpsAll) / sizeof(*kbpsAll); ++iKbps) {
+      for (size_t iWork = 0; iWork < sizeof(msecWorkAll) / sizeof(*msecWorkAll); ++iWork) {
+        Scenario scenario = Scenario();
+
+        scenario.sectors    = (iSource == 1);
+        scenario.interrupt  = (iSource == 2);
+        scenario.kbps       = kbpsAll[iKbps];
+        scenario.msecWork   = msecWorkAll[iWork];
+        scenario.msecFile   = 4000;
+        scenario.msecCancel = 2000;
+
+        print(scenario, run(scenario));
+      }
+    }
+  }
+
+  printf("\nqueue    kbps  work  files  streams  under    gap/ms  total/ms\n");
+
+  for (int iGapless = 1; iGapless >= 0; --iGapless) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Playlist playlist = Playlist();
+
+      playlist.gapless  = (iGapless == 1);
+      playlist.kbps     = 128;
+      playlist.msecWork = msecWorkAll[iWork];
+      playlist.msecFile = 1500;
+      playlist.nFiles   = 4;
+
+      print(playlist, run(playlist));
+    }
+  }
+
+  printf("\njump     kbps  work  jump/ms  streams  latency/ms  silence/ms  refused\n");
+
+  for (int iKind = 0; iKind < 3; ++iKind) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Jump jump = Jump();
+
+      jump.restart   = (iKind == 1);
+      jump.queued    = (iKind == 2);
+      jump.kbps      = 128;
+      jump.msecWork  = msecWorkAll[iWork];
+      jump.msecDelta = 3000;
+
+      print(jump, run(jump));
+    }
+  }
+
+  printf("\nstop     work  idle/ms   bytes  streams  resets\n");
+
+  for (int iKind = STOP_END; iKind <= STOP_STUCK; ++iKind) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Stop stop = Stop();
+
+      stop.kind     = (StopKind) iKind;
+      stop.msecWork = msecWorkAll[iWork];
+
+      print(stop, run(stop));
+    }
+  }
+
+  printf("\nzones    zones  kbps  work  under    dry/ms  margin/ms  busy/%%\n");
+
+  for (int iAll = 0; iAll < 2; ++iAll) {
+    for (size_t nZones = 2; nZones <= ZONES_MAX; ++nZones) {
+      static unsigned long const msecWorkZones[] = { 10, 50, 80 };
+
+      for (size_t iWork = 0; iWork < sizeof(msecWorkZones) / sizeof(*msecWorkZones); ++iWork) {
+        Zones zones = Zones();
+
+        zones.all      = (iAll == 1);
+        zones.nZones   = nZones;
+        zones.kbps     = 192;
+        zones.msecWork = msecWorkZones[iWork];
+
+        print(zones, run(zones));
+      }
+    }
+  }
+
+  printf("\nclip     work  latency/ms  dry/ms  blocks\n");
+
+  for (int iSource = CLIP_FILE; iSource <= CLIP_MEMORY_PROGMEM; ++iSource) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Clip clip = Clip();
+
+      clip.source   = (ClipSource) iSource;
+      clip.msecWork = msecWorkAll[iWork];
+
+      print(clip, run(clip));
+    }
+  }
+
+  printf("\nbank   files  latency/ms  blocks\n");
+
+  static size_t const nFilesAll[] = { 10, 100, 500 };
+
+  for (int iSource = BANK_OPEN; iSource <= BANK_BANK; ++iSource) {
+    for (size_t iFiles = 0; iFiles < sizeof(nFilesAll) / sizeof(*nFilesAll); ++iFiles) {
+      Bank bank = Bank();
+
+      bank.source = (BankSource) iSource;
+      bank.nFiles = nFilesAll[iFiles];
+
+      print(bank, run(bank));
+    }
+  }
+
+  printf("\npower  after  down/%%  latency/ms  volume  too fast\n");
+
+  static unsigned long const msecPowerDownAfterAll[] = { 0, 100, 1000 };
+
+  for (size_t iAfter = 0; iAfter < sizeof(msecPowerDownAfterAll) / sizeof(*msecPowerDownAfterAll); ++iAfter) {
+    for (int iTrigger = POWER_PLAY; iTrigger <= POWER_CLIP; ++iTrigger) {
+      Power power = Power();
+
+      power.msecPowerDownAfter = msecPowerDownAfterAll[iAfter];
+      power.trigger            = (PowerTrigger) iTrigger;
+
+      print(power, run(power));
+    }
+  }
+
+  {
+    Power power = Power();
+
+    power.trigger = POWER_RESET;
+
+    print(power, run(power));
+  }
+
+  printf("\ntags      source   work  start/ms  blocks   tag/B  tail/B  sent/B\n");
+
+  for (int iKind = TAG_NONE; iKind <= TAG_BOTH; ++iKind) {
+    for (int iSectors = 0; iSectors < 2; ++iSectors) {
+      for (size_t iWork = 0; iWork < 2; ++iWork) {
+        Tags tags = Tags();
+
+        tags.kind     = (TagKind) iKind;
+        tags.sectors  = (iSectors == 1);
+        tags.msecWork = msecWorkAll[iWork];
+
+        print(tags, run(tags));
+      }
+    }
+  }
+
+  printf("\nstream  buffer  work  under    dry/ms  busy/%%\n");
+
+  static size_t        const nBytesBufferAll[] = { 64, 512 };
+  static unsigned long const msecWorkStream[]  = { 0, 2, 5, 10, 20 };
+
+  for (size_t iBuffer = 0; iBuffer < sizeof(nBytesBufferAll) / sizeof(*nBytesBufferAll); ++iBuffer) {
+    for (size_t iWork = 0; iWork < sizeof(msecWorkStream) / sizeof(*msecWorkStream); ++iWork) {
+      Streaming streaming = Streaming();
+
+      streaming.nBytesBuffer = nBytesBufferAll[iBuffer];
+      streaming.msecWork     = msecWorkStream[iWork];
+
+      print(streaming, run(streaming));
+    }
+  }
+
+  printf("\nposition kbps  work  error/ms  mean/ms  sci/s\n");
+
+  for (int iMsec = 1; iMsec >= 0; --iMsec) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Position position = Position();
+
+      position.positionMsec = (iMsec == 1);
+      position.kbps         = 128;
+      position.msecWork     = msecWorkAll[iWork];
+
+      print(position, run(position));
+    }
+  }
+
+  printf("\nfade     work  writes  step/dB  late/ms  under\n");
+
+  for (int iSketch = 1; iSketch >= 0; --iSketch) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Fade fade = Fade();
+
+      fade.sketch   = (iSketch == 1);
+      fade.msecWork = msecWorkAll[iWork];
+
+      print(fade, run(fade));
+    }
+  }
+
+  printf("\nrecord  rate   work    kbps    lost  backlog/ms  write/ms  busy/%%\n");
+
+  for (size_t nBlocks = 1; nBlocks <= 2; ++nBlocks) {
+    static unsigned long const sampleRateAll[]     = { 8000, 24000, 48000 };
+    static unsigned long const msecWorkRecording[] = { 0, 20, 50 };
+
+    for (size_t iRate = 0; iRate < sizeof(sampleRateAll) / sizeof(*sampleRateAll); ++iRate) {
+      for (size_t iWork = 0; iWork < sizeof(msecWorkRecording) / sizeof(*msecWorkRecording); ++iWork) {
+        Recording recording = Recording();
+
+        recording.sampleRate = sampleRateAll[iRate];
+        recording.nBlocks    = nBlocks;
+        recording.msecWork   = msecWorkRecording[iWork];
+
+        print(recording, run(recording));
+      }
+    }
+  }
+
+  printf("\nplugin    source   words     sci  early   load/ms\n");
+
+  for (int iPerWord = 0; iPerWord < 2; ++iPerWord) {
+    for (int iFile = 0; iFile < 2; ++iFile) {
+      Plugin plugin = Plugin();
+
+      plugin.perWord = (iPerWord == 1);
+      plugin.file    = (iFile == 1);
+
+      print(plugin, run(plugin));
+    }
+  }
+
+  printf("\nspectrum  kbps  work  frames/s  sci/s  under    dry/ms  busy/%%\n");
+
+  for (int iSpectrum = 0; iSpectrum < 2; ++iSpectrum) {
+    for (size_t iWork = 0; iWork < 3; ++iWork) {
+      Spectrum spectrum = Spectrum();
+
+      spectrum.spectrum = (iSpectrum == 1);
+      spectrum.kbps     = 320;
+      spectrum.msecWork = msecWorkAll[iWork];
+
+      print(spectrum, run(spectrum));
+    }
+  }
+
+  printf("\noverlay   feed  kbps  work  samples  mixer/ms  under    dry/ms  busy/%%\n");
+
+  for (int iSource = OVERLAY_NONE; iSource <= OVERLAY_FILE; ++iSource) {
+    for (int iInterrupt = 0; iInterrupt < 2; ++iInterrupt) {
+      for (size_t iKbps = 0; iKbps < 3; iKbps += 2) {
+        for (size_t iWork = 0; iWork < 2; ++iWork) {
+          Overlay overlay = Overlay();
+
+          overlay.source    = (OverlaySource) iSource;
+          overlay.interrupt = (iInterrupt == 1);
+          overlay.kbps      = kbpsAll[iKbps];
+          overlay.msecWork  = msecWorkAll[iWork];
+
+          print(overlay, run(overlay));
+        }
+      }
+    }
+  }
+
+  printf("\nreset     chip    work  ready/ms  call/ms  state\n");
+
+  for (int iHardware = 0; iHardware < 2; ++iHardware) {
+    for (int iChip = 0; iChip < 3; ++iChip) {
+      for (size_t iWork = 0; iWork < 2; ++iWork) {
+        Reset reset = Reset();
+
+        reset.hardware = (iHardware == 1);
+        reset.hung     = (iChip >= 1);
+        reset.asleep   = (iChip == 2);
+        reset.msecWork = iWork;
+
+        print(reset, run(reset));
+      }
+    }
+  }
+
+  printf("\ndeadline  effect   kbps   job  jobs/s  mixer/ms  under    dry/ms  busy/%%\n");
+
+  static unsigned long const kbpsDeadline[]    = { 128, 320 };
+  static unsigned long const msecJobDeadline[] = { 10, 40, 50, 100 };
+
+  for (int iDeadline = 0; iDeadline < 2; ++iDeadline) {
+    for (int iOverlay = 0; iOverlay < 2; ++iOverlay) {
+      for (size_t iKbps = 0; iKbps < sizeof(kbpsDeadline) / sizeof(*kbpsDeadline); ++iKbps) {
+        for (size_t iJob = 0; iJob < sizeof(msecJobDeadline) / sizeof(*msecJobDeadline); ++iJob) {
+          Deadline deadline = Deadline();
+
+          deadline.deadline = (iDeadline == 1);
+          deadline.overlay  = (iOverlay == 1);
+          deadline.kbps     = kbpsDeadline[iKbps];
+          deadline.msecJob  = msecJobDeadline[iJob];
+
+          print(deadline, run(deadline));
+        }
+      }
+    }
+  }
+
+  printf("\nbus      kbps  work  under    dry/ms  busy/%%  too fast\n");
+
+  static uint8_t const dividerAll[] = { SPI_CLOCK_DIV2, SPI_CLOCK_DIV4, SPI_CLOCK_DIV16, SPI_CLOCK_DIV64 };
+
+  for (size_t iDivider = 0; iDivider < sizeof(dividerAll) / sizeof(*dividerAll); ++iDivider) {
+    for (size_t iWork = 0; iWork < 2; ++iWork) {
+      Bus bus = Bus();
+
+      bus.divider  = dividerAll[iDivider];
+      bus.kbps     = 320;
+      bus.msecWork = msecWorkAll[iWork + 1];
+
+      print(bus, run(bus));
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side stand-in for the Arduino SD library, backed by the simulator.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#ifndef SD_H
+#define SD_H
+
+#include <Arduino.h>
+
+
+class SimFile;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File
+//
+
+class File : public Stream
+{
+public:
+  File();
+  File(SimFile* file);
+
+  int read(void* bytes, uint16_t nBytes);
+  size_t write(uint8_t const* bytes, size_t nBytes);
+  void flush();
+
+  virtual int available();
+  virtual int read();
+  virtual int peek();
+
+  bool seek(uint32_t position);
+  uint32_t position();
+  uint32_t size();
+
+  operator bool ();
+
+private:
+  SimFile* _file;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Sd2Card
+//  SdFile
+//
+
+class Sd2Card
+{
+public:
+  uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
+};
+
+
+class SdFile
+{
+public:
+  SdFile();
+  SdFile(SimFile* file);
+
+  uint8_t contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock);
+
+  uint32_t curPosition() const;
+  uint32_t fileSize() const;
+
+private:
+  SimFile* _file;
+};
+
+
+#endif
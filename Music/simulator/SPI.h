@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side stand-in for the Arduino SPI library, backed by the simulator.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#ifndef SPI_H
+#define SPI_H
+
+#include <avr/io.h>
+
+#include <Arduino.h>
+
+
+#define SPI_CLOCK_DIV4    0x00
+#define SPI_CLOCK_DIV16   0x01
+#define SPI_CLOCK_DIV64   0x02
+#define SPI_CLOCK_DIV128  0x03
+#define SPI_CLOCK_DIV2    0x04
+#define SPI_CLOCK_DIV8    0x05
+#define SPI_CLOCK_DIV32   0x06
+
+#define SPI_MODE0  0x00
+
+#define MSBFIRST   1
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SPISettings
+//
+
+class SPISettings
+{
+public:
+  SPISettings();
+  SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode);
+
+private:
+  void init(uint32_t clock);
+
+  uint8_t _spcr;
+  uint8_t _spsr;
+
+  friend class SPIClass;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SPIClass
+//
+
+class SPIClass
+{
+public:
+  static void begin();
+
+  static uint8_t transfer(uint8_t value);
+
+  static void usingInterrupt(uint8_t interruptNumber);
+
+  static void beginTransaction(SPISettings settings);
+  static void endTransaction();
+
+  static void setBitOrder(uint8_t order);
+  static void setDataMode(uint8_t mode);
+  static void setClockDivider(uint8_t divider);
+};
+
+
+extern SPIClass SPI;
+
+
+#endif
@@ -0,0 +1,1607 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side simulation of a VS1053b-based expansion board, for running
+//  the Music library on a Linux machine against a virtual clock.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#include <stdlib.h>
+
+#include <avr/io.h>
+#include <SPI.h>
+
+#include "Simulator.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Sim (instantiation)
+//
+
+Simulator Sim;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SimDecoder
+//
+
+static uint16_t const SM_RESET  = (0x1 <<  2);
+static uint16_t const SM_CANCEL = (0x1 <<  3);
+static uint16_t const SM_SDINEW = (0x1 << 11);
+static uint16_t const SM_ADPCM  = (0x1 << 12);
+
+static uint8_t const SCI_MODE        = 0x0;
+static uint8_t const SCI_CLOCKF      = 0x3;
+static uint8_t const SCI_DECODE_TIME = 0x4;
+static uint8_t const SCI_WRAM        = 0x6;
+static uint8_t const SCI_WRAMADDR    = 0x7;
+static uint8_t const SCI_HDAT0       = 0x8;
+static uint8_t const SCI_HDAT1       = 0x9;
+static uint8_t const SCI_VOL         = 0xB;
+static uint8_t const SCI_AIADDR      = 0xA;
+static uint8_t const SCI_AICTRL0     = 0xC;
+static uint8_t const SCI_AICTRL1     = 0xD;
+static uint8_t const SCI_AICTRL2     = 0xE;
+
+static uint16_t const PARAMETRIC_BYTE_RATE     = 0x1E05;
+static uint16_t const PARAMETRIC_END_FILL_BYTE = 0x1E06;
+static uint16_t const PARAMETRIC_POSITION_LO   = 0x1E27;
+static uint16_t const PARAMETRIC_POSITION_HI   = 0x1E28;
+
+
+SimDecoder::SimDecoder()
+  : byteRate                (16000)
+  , byteRateFast            (256000)
+  , nBytesCancel            (512)
+  , positionMsec            (false)
+  , mixerRate               (0)
+  , hung                    (false)
+  , memory                  (0x10000, 0)
+  , addressPinReset         (NOT_A_PIN)
+  , addressPinRequest       (NOT_A_PIN)
+  , addressPinSelectData    (NOT_A_PIN)
+  , addressPinSelectControl (NOT_A_PIN)
+  , _reset                  (false)
+  , _selectData             (false)
+  , _selectControl          (false)
+  , _nanos                  (0)
+  , _fifoLength             (0)
+  , _nBytesTagRemaining     (0)
+  , _audio                  (false)
+  , _nanosAudio             (0)
+{
+  clearStatistics();
+  reset(0);
+}
+
+
+void SimDecoder::begin(uint8_t addressPinReset, uint8_t addressPinRequest, uint8_t addressPinSelectData, uint8_t addressPinSelectControl)
+{
+  this->addressPinReset         = addressPinReset;
+  this->addressPinRequest       = addressPinRequest;
+  this->addressPinSelectData    = addressPinSelectData;
+  this->addressPinSelectControl = addressPinSelectControl;
+
+  Sim.attach(*this);
+}
+
+
+void SimDecoder::clearStatistics()
+{
+  nBytesData     = 0;
+  nBytesTaken    = 0;
+  nBytesTag      = 0;
+  nBytesOverrun  = 0;
+  nUnderruns     = 0;
+  nanosUnderrun  = 0;
+  nanosMarginMin = UINT64_MAX;
+  nanosGap       = 0;
+  nStreams       = 0;
+  nanosStream    = 0;
+  nCancels       = 0;
+  nResets        = 0;
+  nSciReads      = 0;
+  nSciWrites     = 0;
+  nSciEarly      = 0;
+  nBytesTooFast  = 0;
+  nVolumeWrites  = 0;
+  volumeStepMax  = 0;
+
+  nWordsEncoded    = 0;
+  nWordsRead       = 0;
+  nWordsLost       = 0;
+  nWordsBacklogMax = 0;
+  nanosPowerDown   = 0;
+  nMixerSamples    = 0;
+  nMixerOverruns   = 0;
+  nanosMixerFirst  = 0;
+  nanosMixerEmpty  = 0;
+}
+
+
+bool SimDecoder::decoding() const
+{
+  return (_state == STATE_DECODING);
+}
+
+
+bool SimDecoder::recording() const
+{
+  return (_state == STATE_RECORDING);
+}
+
+
+unsigned long SimDecoder::msecDecoded() const
+{
+  // time played since SCI_DECODE_TIME was last written
+
+  return _decodeTime * 1000UL + (byteRate > 0 ? (uint64_t) _nBytesDecoded * 1000 / byteRate : 0);
+}
+
+
+void SimDecoder::reset(uint64_t nanosBusy)
+{
+  for (size_t iRegister = 0; iRegister < 16; ++iRegister)
+    registers[iRegister] = 0;
+
+  registers[SCI_MODE] = SM_SDINEW;
+
+  _state = STATE_IDLE;
+
+  _nanosBusyUntil = _nanos + nanosBusy;
+  _nanosRemainder = 0;
+
+  nBytesTaken += _fifoLength;
+
+  _fifoHead   = 0;
+  _fifoLength = 0;
+  _primed     = false;
+
+  _nBytesTagRemaining = 0;
+  _underrun   = false;
+
+  _cancel = false;
+  _nBytesCancelRemaining = 0;
+
+  _nBytesFill    = 0;
+  _nBytesDecoded = 0;
+  _decodeTime    = 0;
+
+  _recordLength    = 0;
+  _recordRemainder = 0;
+  _recordWord      = 0;
+
+  _mixer          = false;
+  _mixerLength    = 0;
+  _mixerRemainder = 0;
+
+  _sciIndex = 0;
+}
+
+
+void SimDecoder::update(uint64_t nanos)
+{
+  uint64_t nanosDelta = nanos - _nanos;
+  _nanos = nanos;
+
+  if (_reset)
+    return;
+
+  if (_state == STATE_IDLE && registers[SCI_VOL] == 0xFFFF && (registers[SCI_CLOCKF] >> 13) == 0)
+    nanosPowerDown += nanosDelta;
+
+  if (_mixer && _mixerLength > 0) {
+    uint64_t nanosBudget = nanosDelta * mixerRate + _mixerRemainder;
+    uint64_t nSamples = nanosBudget / 1000000000;
+
+    _mixerRemainder = nanosBudget % 1000000000;
+
+    if (nSamples >= _mixerLength) {
+      nanosMixerEmpty = _nanos - (nSamples - _mixerLength) * 1000000000 / mixerRate;
+
+      _mixerLength    = 0;
+      _mixerRemainder = 0;
+    }
+    else {
+      _mixerLength -= nSamples;
+    }
+  }
+
+  if (_state == STATE_RECORDING) {
+    // mono IMA ADPCM takes 256 bytes for every 505 samples
+
+    uint64_t wordRate = (uint64_t) registers[SCI_AICTRL0] * 128 / 505;
+
+    if (_nanos < _nanosBusyUntil)
+      return;
+
+    uint64_t nanosBudget = nanosDelta * wordRate + _recordRemainder;
+    uint64_t nWords = nanosBudget / 1000000000;
+
+    _recordRemainder = nanosBudget % 1000000000;
+
+    nWordsEncoded += nWords;
+
+    if (nWords > RECORD_SIZE - _recordLength) {
+      nWordsLost += nWords - (RECORD_SIZE - _recordLength);
+      nWords = RECORD_SIZE - _recordLength;
+    }
+
+    _recordLength += nWords;
+
+    if (_recordLength > nWordsBacklogMax)
+      nWordsBacklogMax = _recordLength;
+
+    return;
+  }
+
+  if (_state == STATE_IDLE) {
+    // outside of a stream, the decoder skims through anything it gets
+    // (usually just end fill bytes) looking for a header to sync to, and
+    // skips an ID3v2 tag as a whole once it has seen the tag's header
+
+    while (_fifoLength > 0) {
+      if (_nBytesTagRemaining == 0 && _fifo[_fifoHead] == 'I') {
+        if (_fifoLength < 10)
+          break;
+
+        _nBytesTagRemaining = tagSize();
+      }
+
+      uint8_t value = _fifo[_fifoHead];
+      _fifoHead = (_fifoHead + 1) % FIFO_SIZE;
+      _fifoLength--;
+      nBytesTaken++;
+
+      if (_nBytesTagRemaining > 0) {
+        _nBytesTagRemaining--;
+        nBytesTag++;
+        continue;
+      }
+
+      consume(value);
+
+      if (_state != STATE_IDLE)
+        break;
+    }
+
+    _nanosRemainder = 0;
+  }
+
+  if (_state != STATE_DECODING)
+    return;
+
+  unsigned long byteRateNow = (_cancel ? byteRateFast : byteRate);
+
+  uint64_t nanosBudget = nanosDelta * byteRateNow + _nanosRemainder;
+  uint64_t nBytesBudget = nanosBudget / 1000000000;
+
+  _nanosRemainder = nanosBudget % 1000000000;
+
+  while (nBytesBudget > 0 && _fifoLength > 0 && _state == STATE_DECODING) {
+    uint8_t value = _fifo[_fifoHead];
+    _fifoHead = (_fifoHead + 1) % FIFO_SIZE;
+    _fifoLength--;
+    nBytesTaken++;
+
+    consume(value);
+    nBytesBudget--;
+  }
+
+  if (_state != STATE_DECODING)
+    return;
+
+  if (nBytesBudget > 0 && _fifoLength == 0) {
+    // ran dry; only counts as an underrun when the last thing decoded was
+    // actual audio rather than the end fill that follows the end of a file
+
+    _nanosRemainder = 0;
+
+    if (_nBytesFill == 0 && !_cancel) {
+      if (!_underrun)
+        nUnderruns++;
+
+      _underrun = true;
+      nanosUnderrun += nBytesBudget * 1000000000 / byteRateNow;
+    }
+  }
+
+  if (_primed && !_cancel && _nBytesFill == 0) {
+    uint64_t nanosMargin = (uint64_t) _fifoLength * 1000000000 / byteRate;
+
+    if (nanosMargin < nanosMarginMin)
+      nanosMarginMin = nanosMargin;
+  }
+}
+
+
+uint32_t SimDecoder::tagSize() const
+{
+  uint8_t bytes[10];
+
+  for (size_t iByte = 0; iByte < 10; ++iByte)
+    bytes[iByte] = _fifo[(_fifoHead + iByte) % FIFO_SIZE];
+
+  if (bytes[1] != 'D' || bytes[2] != '3')
+    return 0;
+
+  uint32_t nBytesTag = (bytes[6] << 21) | (bytes[7] << 14) | (bytes[8] << 7) | bytes[9];
+
+  return 10 + nBytesTag + ((bytes[5] & 0x10) ? 10 : 0);
+}
+
+
+void SimDecoder::consume(uint8_t value)
+{
+  uint8_t valueFill = (uint8_t) memory[PARAMETRIC_END_FILL_BYTE];
+
+  if (_state == STATE_IDLE) {
+    if (value == valueFill)
+      return;
+
+    _state = STATE_DECODING;
+    _nBytesFill = 0;
+    _primed = false;
+    _underrun = false;
+    nStreams++;
+    nanosStream = _nanos;
+  }
+
+  _nBytesDecoded++;
+
+  if (_cancel) {
+    if (_nBytesCancelRemaining > 0)
+      _nBytesCancelRemaining--;
+
+    if (_audio) {
+      _audio = false;
+      _nanosAudio = _nanos;
+    }
+
+    if (_nBytesCancelRemaining == 0) {
+      _cancel = false;
+      _state = STATE_IDLE;
+      registers[SCI_MODE] &= ~SM_CANCEL;
+      nCancels++;
+
+      // whatever is left of the cancelled stream is dropped
+      nBytesTaken += _fifoLength;
+      _fifoLength = 0;
+    }
+
+    return;
+  }
+
+  if (value != valueFill) {
+    if (!_audio && nStreams > 1)
+      nanosGap += _nanos - _nanosAudio;
+
+    _audio = true;
+  }
+  else if (_audio) {
+    _audio = false;
+    _nanosAudio = _nanos;
+  }
+
+  if (value == valueFill) {
+    // enough end fill bytes have made it through the decoder to be sure
+    // that every last bit of audio has been played
+
+    if (++_nBytesFill >= 2048)
+      _state = STATE_IDLE;
+  }
+  else {
+    _nBytesFill = 0;
+  }
+}
+
+
+void SimDecoder::receive(uint8_t value)
+{
+  if (_reset)
+    return;
+
+  nBytesData++;
+
+  if (_fifoLength == FIFO_SIZE) {
+    nBytesOverrun++;
+    return;
+  }
+
+  _fifo[(_fifoHead + _fifoLength) % FIFO_SIZE] = value;
+  _fifoLength++;
+
+  _underrun = false;
+
+  if (FIFO_SIZE - _fifoLength < 32)
+    _primed = true;
+}
+
+
+bool SimDecoder::request() const
+{
+  if (hung || _reset || _nanos < _nanosBusyUntil)
+    return false;
+
+  return (FIFO_SIZE - _fifoLength >= 32);
+}
+
+
+void SimDecoder::pin(uint8_t address, uint8_t value)
+{
+  if (address == addressPinReset) {
+    if (value == LOW && !_reset) {
+      _reset = true;
+      reset(0);
+      nResets++;
+    }
+    else if (value == HIGH && _reset) {
+      // DREQ stays low for about 22000 XTALI cycles after a hardware reset
+      _reset = false;
+      _nanosBusyUntil = _nanos + 1800000;
+    }
+  }
+
+  if (address == addressPinSelectData)
+    _selectData = (value == LOW);
+
+  if (address == addressPinSelectControl) {
+    _selectControl = (value == LOW);
+    _sciIndex = 0;
+  }
+}
+
+
+uint8_t SimDecoder::transfer(uint8_t value, unsigned long hzSpi)
+{
+  if (_selectData && !_selectControl) {
+    if (hzSpi > hzClock() / 4)
+      nBytesTooFast++;
+
+    receive(value);
+    return 0x00;
+  }
+
+  if (!_selectControl || _reset)
+    return 0xFF;
+
+  // SCI: opcode, address, then any number of 16-bit words (most
+  // significant byte first) for multiple reads or writes
+
+  uint8_t opcode = (_sciIndex == 0 ? value : _sciOpcode);
+
+  if (hzSpi > hzClock() / (opcode == 0x03 ? 7 : 4))
+    nBytesTooFast++;
+
+  uint8_t index = _sciIndex++;
+
+  if (_sciIndex == 0)
+    _sciIndex = 2;
+
+  switch (index) {
+    case 0:  _sciOpcode  = value;        return 0x00;
+    case 1:  _sciAddress = value & 0xF;  return 0x00;
+  }
+
+  bool high = ((index & 1) == 0);
+
+  if (_sciOpcode == 0x03) {
+    if (high)
+      _sciValue = readRegister(_sciAddress);
+
+    return (high ? _sciValue >> 8 : _sciValue & 0xFF);
+  }
+
+  if (_sciOpcode == 0x02) {
+    if (high) {
+      _sciValue = (uint16_t) value << 8;
+    }
+    else {
+      _sciValue |= value;
+      writeRegister(_sciAddress, _sciValue);
+    }
+  }
+
+  return 0x00;
+}
+
+
+unsigned long SimDecoder::hzClock() const
+{
+  // CLKI is XTALI times SC_MULT; SC_ADD only ever adds to that
+
+  static uint8_t const multipliersTimes2[8] = { 2, 4, 5, 6, 7, 8, 9, 10 };
+
+  uint16_t clockf = registers[SCI_CLOCKF];
+
+  unsigned long hzXtali = ((clockf & 0x7FF) == 0 ? 12288000 : 8000000 + (clockf & 0x7FF) * 4000UL);
+
+  return hzXtali / 2 * multipliersTimes2[clockf >> 13];
+}
+
+
+uint16_t SimDecoder::readRegister(uint8_t address)
+{
+  nSciReads++;
+
+  switch (address) {
+    case SCI_DECODE_TIME:
+      if (_state == STATE_DECODING && byteRate > 0)
+        return _decodeTime + _nBytesDecoded / byteRate;
+      return _decodeTime;
+
+    case SCI_WRAM:
+      return readMemory(registers[SCI_WRAMADDR]++);
+
+    case SCI_HDAT0:
+      if (_state == STATE_RECORDING) {
+        if (_recordLength == 0)
+          return 0;
+
+        _recordLength--;
+        nWordsRead++;
+        return _recordWord++;
+      }
+
+      return (_state == STATE_DECODING ? byteRate * 8 / 1000 : 0);
+
+    case SCI_AICTRL1:
+      if (_mixer)
+        return MIXER_SIZE - _mixerLength;
+      break;
+
+    case SCI_HDAT1:
+      if (_state == STATE_RECORDING)
+        return _recordLength;
+
+      return (_state == STATE_DECODING ? 0xFFFB : 0);  // MPEG 1 Layer III
+  }
+
+  return registers[address];
+}
+
+
+void SimDecoder::writeRegister(uint8_t address, uint16_t value)
+{
+  nSciWrites++;
+
+  if (_nanos < _nanosBusyUntil)
+    nSciEarly++;
+
+  // execution times in CLKI cycles at 12.288 MHz, see datasheet
+  uint64_t nanosBusy = 80 * 1000 / 12;
+
+  switch (address) {
+    case SCI_MODE:
+      if (value & SM_RESET) {
+        // the analog input settings survive a software reset, and they
+        // are what the encoder starts with if SM_ADPCM is set; so does
+        // the clock
+
+        uint16_t aictrl[4];
+
+        for (size_t iRegister = 0; iRegister < 4; ++iRegister)
+          aictrl[iRegister] = registers[SCI_AICTRL0 + iRegister];
+
+        uint16_t clockf = registers[SCI_CLOCKF];
+
+        reset(1000000);
+
+        for (size_t iRegister = 0; iRegister < 4; ++iRegister)
+          registers[SCI_AICTRL0 + iRegister] = aictrl[iRegister];
+
+        registers[SCI_CLOCKF] = clockf;
+
+        registers[SCI_MODE] = value & ~SM_RESET;
+        nResets++;
+
+        if (value & SM_ADPCM)
+          _state = STATE_RECORDING;
+
+        return;
+      }
+
+      if ((value & SM_CANCEL) && !(registers[SCI_MODE] & SM_CANCEL)) {
+        if (_state == STATE_DECODING) {
+          _cancel = true;
+          _nBytesCancelRemaining = nBytesCancel;
+        }
+        else {
+          value &= ~SM_CANCEL;
+        }
+      }
+      break;
+
+    case SCI_CLOCKF:
+      nanosBusy = 100000;
+      break;
+
+    case SCI_VOL:
+      // going to or from silence (0xFE) is a step by definition
+
+      for (int shift = 0; shift <= 8; shift += 8) {
+        int levelPrev = (registers[SCI_VOL] >> shift) & 0xFF;
+        int levelNext = (value              >> shift) & 0xFF;
+
+        int step = abs(levelNext - levelPrev);
+
+        if (levelPrev < 0xFE && levelNext < 0xFE && step > volumeStepMax)
+          volumeStepMax = step;
+      }
+
+      nVolumeWrites++;
+      break;
+
+    case SCI_DECODE_TIME:
+      _decodeTime = value;
+      _nBytesDecoded = 0;
+      break;
+
+    case SCI_WRAM:
+      memory[registers[SCI_WRAMADDR]++] = value;
+      nanosBusy = 100 * 1000 / 12;
+      _nanosBusyUntil = _nanos + nanosBusy;
+      return;
+
+    case SCI_WRAMADDR:
+      nanosBusy = 100 * 1000 / 12;
+      break;
+
+    case SCI_AIADDR:
+      if (value != 0 && mixerRate > 0)
+        _mixer = true;
+      break;
+
+    case SCI_AICTRL2:
+      if (!_mixer)
+        break;
+
+      if (_mixerLength == MIXER_SIZE) {
+        nMixerOverruns++;
+      }
+      else {
+        if (nMixerSamples == 0)
+          nanosMixerFirst = _nanos;
+
+        nMixerSamples++;
+        _mixerLength++;
+      }
+      break;
+  }
+
+  registers[address] = value;
+  _nanosBusyUntil = _nanos + nanosBusy;
+}
+
+
+uint16_t SimDecoder::readMemory(uint16_t address)
+{
+  switch (address) {
+    case PARAMETRIC_BYTE_RATE:
+      return (_state == STATE_DECODING ? byteRate : 0);
+
+    case PARAMETRIC_POSITION_LO:
+    case PARAMETRIC_POSITION_HI:
+      if (!positionMsec || _state != STATE_DECODING)
+        return 0xFFFF;
+
+      return (address == PARAMETRIC_POSITION_LO ? msecDecoded() & 0xFFFF : msecDecoded() >> 16);
+  }
+
+  return memory[address];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SimFile
+//
+
+SimFile::SimFile(size_t nBytes)
+  : data         (nBytes)
+  , position     (0)
+  , positionCard (0)
+  , blockFirst   (0)
+{
+  // anything but zero, which is the default end fill byte
+
+  for (size_t iByte = 0; iByte < nBytes; ++iByte)
+    data[iByte] = (uint8_t) (iByte * 31 + 7) | 0x01;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SimStream
+//
+
+SimStream::SimStream(SimFile& file, unsigned long byteRate, size_t nBytesBuffer)
+  : _file           (file)
+  , _byteRate       (byteRate)
+  , _nBytesBuffer   (nBytesBuffer)
+  , _nanosPrev      (Sim.nanos())
+  , _nanosRemainder (0)
+{
+  _file.position = 0;
+}
+
+
+int SimStream::available()
+{
+  Sim.elapse(Sim.nanosStreamCall);
+  update();
+
+  return _buffer.size();
+}
+
+
+int SimStream::read()
+{
+  Sim.elapse(Sim.nanosStreamCall);
+  update();
+
+  if (_buffer.empty())
+    return -1;
+
+  uint8_t value = _buffer.front();
+  _buffer.pop_front();
+
+  return value;
+}
+
+
+int SimStream::peek()
+{
+  Sim.elapse(Sim.nanosStreamCall);
+  update();
+
+  return (_buffer.empty() ? -1 : _buffer.front());
+}
+
+
+void SimStream::update()
+{
+  // Whatever the sender could have sent since the last call, as far as
+  // it fit into the receive buffer. Once that's full, the sender waits,
+  // and only picks up again once something has been read.
+
+  uint64_t nanos = Sim.nanos();
+
+  uint64_t nanosBudget = (nanos - _nanosPrev) * _byteRate + _nanosRemainder;
+  uint64_t nBytes = nanosBudget / 1000000000;
+
+  _nanosPrev      = nanos;
+  _nanosRemainder = nanosBudget % 1000000000;
+
+  for (; nBytes > 0 && _file.position < _file.data.size(); --nBytes) {
+    if (_buffer.size() == _nBytesBuffer) {
+      _nanosRemainder = 0;
+      break;
+    }
+
+    _buffer.push_back(_file.data[_file.position++]);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Simulator
+//
+
+Simulator::Simulator()
+  : nanosDigital       (3500)
+  , nanosClock         (1500)
+  , nanosTransferCall  (500)
+  , nanosTransaction   (1000)
+  , nanosSdCall        (30000)
+  , nanosStreamCall    (1500)
+  , nanosSdCommand     (200000)
+  , nanosSdByte        (1000)
+  , nanosSdCopyByte    (500)
+  , nanosSdProgram     (700000)
+  , nanosSdStall       (150000000)
+  , nBlocksPerStall    (256)
+  , nBlocksPerCluster  (64)
+  , spcr               (0)
+  , spsr               (0)
+  , nBytesCollision    (0)
+  , nBlocksRead        (0)
+  , nBlocksWritten     (0)
+  , handlerPinChange   (0)
+  , nInterrupts        (0)
+  , _nanos             (0)
+  , _interruptsEnabled (true)
+  , _interruptPending  (false)
+  , _interruptActive   (false)
+  , _nDecoders         (0)
+  , _blockNext         (1024)
+  , _blockCached       (0xFFFFFFFF)
+  , _blockDirty        (false)
+{
+  for (size_t iPin = 0; iPin < PINS_MAX; ++iPin)
+    _pins[iPin] = LOW;
+}
+
+
+uint64_t Simulator::nanos() const
+{
+  return _nanos;
+}
+
+
+void Simulator::elapse(uint64_t nanos)
+{
+  // advance in small steps, so that interrupts are raised in a timely
+  // manner even while the sketch is busy with something else for long
+
+  static uint64_t const nanosStep = 50000;
+
+  do {
+    uint64_t nanosDelta = (nanos < nanosStep ? nanos : nanosStep);
+
+    _nanos += nanosDelta;
+    nanos  -= nanosDelta;
+
+    for (size_t iDecoder = 0; iDecoder < _nDecoders; ++iDecoder)
+      _decoders[iDecoder]->update(_nanos);
+
+    checkPinChange();
+  }
+  while (nanos > 0);
+}
+
+
+void Simulator::enableInterrupts(bool enable)
+{
+  _interruptsEnabled = enable;
+
+  if (enable)
+    checkPinChange();
+}
+
+
+void Simulator::checkPinChange()
+{
+  // A change on any DREQ pin whose pin change interrupt is enabled raises
+  // the interrupt; it is handled as soon as interrupts are enabled and no
+  // other handler is running. Since the simulated clock only advances in
+  // calls to the Arduino core, SPI and SD stand-ins, that's also where the
+  // handler gets called - still plenty of opportunity to catch races.
+
+  for (size_t iDecoder = 0; iDecoder < _nDecoders; ++iDecoder) {
+    SimDecoder& decoder = *_decoders[iDecoder];
+
+    bool request = decoder.request();
+
+    if (request == _requestPrev[iDecoder])
+      continue;
+
+    _requestPrev[iDecoder] = request;
+
+    uint8_t address = decoder.addressPinRequest;
+
+    if (digitalPinToPCICR(address)
+        && (*digitalPinToPCICR(address) & _BV(digitalPinToPCICRbit(address)))
+        && (*digitalPinToPCMSK(address) & _BV(digitalPinToPCMSKbit(address))))
+      _interruptPending = true;
+  }
+
+  if (!_interruptPending || !_interruptsEnabled || _interruptActive || !handlerPinChange)
+    return;
+
+  _interruptPending = false;
+  _interruptActive  = true;
+
+  nInterrupts++;
+  handlerPinChange();
+
+  _interruptActive = false;
+}
+
+
+void Simulator::pinMode(uint8_t address, uint8_t mode)
+{
+  (void) address;
+  (void) mode;
+}
+
+
+void Simulator::digitalWrite(uint8_t address, uint8_t value)
+{
+  elapse(nanosDigital);
+
+  if (address >= PINS_MAX)
+    return;
+
+  _pins[address] = value;
+
+  for (size_t iDecoder = 0; iDecoder < _nDecoders; ++iDecoder)
+    _decoders[iDecoder]->pin(address, value);
+}
+
+
+uint8_t Simulator::digitalRead(uint8_t address)
+{
+  elapse(nanosDigital);
+
+  for (size_t iDecoder = 0; iDecoder < _nDecoders; ++iDecoder) {
+    if (_decoders[iDecoder]->addressPinRequest == address)
+      return (_decoders[iDecoder]->request() ? HIGH : LOW);
+  }
+
+  return (address < PINS_MAX ? _pins[address] : LOW);
+}
+
+
+unsigned long Simulator::hzSpi() const
+{
+  static uint8_t const shifts[4] = { 2, 4, 6, 7 };
+
+  return (16000000UL >> shifts[spcr & 0x3]) << (spsr & _BV(SPI2X) ? 1 : 0);
+}
+
+
+uint64_t Simulator::nanosPerByte() const
+{
+  // 16 MHz system clock, divided by 4, 16, 64 or 128 (SPR1:0),
+  // and twice as fast if SPI2X is set
+
+  static uint8_t const shifts[4] = { 2, 4, 6, 7 };
+
+  uint64_t nanosPerBit = (62 << shifts[spcr & 0x3]) >> (spsr & _BV(SPI2X) ? 1 : 0);
+
+  return 8 * nanosPerBit;
+}
+
+
+uint8_t Simulator::transfer(uint8_t value)
+{
+  elapse(nanosPerByte());
+
+  uint8_t result = 0xFF;
+  size_t nSelected = 0;
+
+  for (size_t iDecoder = 0; iDecoder < _nDecoders; ++iDecoder) {
+    SimDecoder& decoder = *_decoders[iDecoder];
+
+    bool selected =
+         (decoder.addressPinSelectData    < PINS_MAX && _pins[decoder.addressPinSelectData]    == LOW)
+      || (decoder.addressPinSelectControl < PINS_MAX && _pins[decoder.addressPinSelectControl] == LOW);
+
+    if (selected) {
+      result = decoder.transfer(value, hzSpi());
+      nSelected++;
+    }
+  }
+
+  if (nSelected > 1)
+    nBytesCollision++;
+
+  return result;
+}
+
+
+SimFile* Simulator::createFile(size_t nBytes)
+{
+  SimFile* file = new SimFile(nBytes);
+
+  file->blockFirst = _blockNext;
+  _blockNext += (nBytes + 511) / 512;
+
+  _files.push_back(file);
+
+  return file;
+}
+
+
+SimFile* Simulator::openFile(size_t index)
+{
+  // Opening a file by its name, like SD.open() does, walks the directory's
+  // 32-byte entries from the start, 16 to a block, comparing each 8.3 name
+  // until it comes across the one for the index-th file created.
+
+  elapse(nanosSdCall);
+
+  if (index >= _files.size())
+    return 0;
+
+  for (size_t iEntry = 0; iEntry <= index; ++iEntry) {
+    readBlock(0xF0000000 + iEntry / 16);
+    elapse(11 * nanosSdCopyByte);
+  }
+
+  _files[index]->position = 0;
+
+  return _files[index];
+}
+
+
+void Simulator::formatCard()
+{
+  // Empties the directory. New files still go on the card behind the old
+  // ones, so that the block cache can't mistake one for the other.
+
+  for (size_t iFile = 0; iFile < _files.size(); ++iFile)
+    delete _files[iFile];
+
+  _files.clear();
+}
+
+
+void Simulator::readBlock(uint32_t block)
+{
+  if (block == _blockCached)
+    return;
+
+  if (_blockDirty)
+    writeBlock();
+
+  elapse(nanosSdCommand + 514 * nanosSdByte);
+  nBlocksRead++;
+
+  _blockCached = block;
+}
+
+
+void Simulator::writeBlock()
+{
+  // Cards take a while to program each block, and now and then quite a
+  // while longer to erase a fresh batch of blocks or to shuffle them
+  // around internally; that's where recordings are most at risk.
+
+  elapse(nanosSdCommand + 514 * nanosSdByte + nanosSdProgram);
+  nBlocksWritten++;
+
+  if (nBlocksPerStall > 0 && nBlocksWritten % nBlocksPerStall == 0)
+    elapse(nanosSdStall);
+
+  _blockDirty = false;
+}
+
+
+int Simulator::writeFile(SimFile& file, uint8_t const* bytes, size_t nBytes)
+{
+  elapse(nanosSdCall);
+
+  size_t nBytesWritten = 0;
+
+  while (nBytesWritten < nBytes) {
+    uint32_t blockInFile = file.position / 512;
+    uint32_t block       = file.blockFirst + blockInFile;
+
+    size_t nBytesBlock = 512 - file.position % 512;
+
+    if (nBytesBlock > nBytes - nBytesWritten)
+      nBytesBlock = nBytes - nBytesWritten;
+
+    // growing into a new cluster means allocating it in the FAT first
+
+    if (file.position % 512 == 0 && file.position == file.data.size()
+        && blockInFile > 0 && blockInFile % nBlocksPerCluster == 0) {
+      readBlock(0xFFFFFFFE - blockInFile / nBlocksPerCluster);
+      _blockDirty = true;
+    }
+
+    if (nBytesBlock == 512) {
+      // a whole block goes straight to the card, bypassing the cache
+
+      if (_blockDirty)
+        writeBlock();
+
+      if (block == _blockCached)
+        _blockCached = 0xFFFFFFFF;
+
+      writeBlock();
+    }
+    else {
+      // anything less is merged into the cached block, which is written
+      // back when another block is needed or the file is flushed
+
+      if (file.position - file.position % 512 < file.data.size()) {
+        readBlock(block);
+      }
+      else if (block != _blockCached) {
+        if (_blockDirty)
+          writeBlock();
+
+        _blockCached = block;
+      }
+
+      elapse(nBytesBlock * nanosSdCopyByte);
+      _blockDirty = true;
+    }
+
+    if (file.position + nBytesBlock > file.data.size())
+      file.data.resize(file.position + nBytesBlock);
+
+    memcpy(&file.data[file.position], bytes + nBytesWritten, nBytesBlock);
+
+    nBytesWritten += nBytesBlock;
+    file.position += nBytesBlock;
+  }
+
+  return (int) nBytesWritten;
+}
+
+
+void Simulator::flushFile(SimFile& file)
+{
+  (void) file;
+
+  elapse(nanosSdCall);
+
+  if (_blockDirty)
+    writeBlock();
+}
+
+
+int Simulator::readFile(SimFile& file, uint8_t* bytes, size_t nBytes)
+{
+  elapse(nanosSdCall);
+
+  size_t nBytesRead = 0;
+
+  while (nBytesRead < nBytes && file.position < file.data.size()) {
+    uint32_t blockInFile = file.position / 512;
+
+    // crossing into a new cluster means looking up the next one in the FAT,
+    // which goes through the same single-block cache as the data itself
+
+    if (file.position % 512 == 0 && blockInFile > 0 && blockInFile % nBlocksPerCluster == 0)
+      readBlock(0xFFFFFFFE - blockInFile / nBlocksPerCluster);
+
+    readBlock(file.blockFirst + blockInFile);
+
+    size_t nBytesBlock = 512 - file.position % 512;
+
+    if (nBytesBlock > nBytes - nBytesRead)
+      nBytesBlock = nBytes - nBytesRead;
+    if (nBytesBlock > file.data.size() - file.position)
+      nBytesBlock = file.data.size() - file.position;
+
+    memcpy(bytes + nBytesRead, &file.data[file.position], nBytesBlock);
+    elapse(nBytesBlock * nanosSdCopyByte);
+
+    nBytesRead    += nBytesBlock;
+    file.position += nBytesBlock;
+  }
+
+  return (int) nBytesRead;
+}
+
+
+bool Simulator::seekFile(SimFile& file, uint32_t position)
+{
+  elapse(nanosSdCall);
+
+  if (position > file.data.size())
+    return false;
+
+  // walking the cluster chain costs a FAT lookup per cluster skipped
+
+  uint32_t clusterFrom = file.position / 512 / nBlocksPerCluster;
+  uint32_t clusterTo   = position      / 512 / nBlocksPerCluster;
+
+  if (clusterTo < clusterFrom)
+    clusterFrom = 0;
+
+  for (uint32_t cluster = clusterFrom; cluster < clusterTo; ++cluster)
+    elapse(nanosSdCall / 10);
+
+  file.position = position;
+
+  return true;
+}
+
+
+bool Simulator::readCard(uint32_t block, uint16_t offset, uint16_t count, uint8_t* bytes)
+{
+  if (offset + count > 512)
+    return false;
+
+  // the card always sends the whole block, no matter how much of it is used
+
+  elapse(nanosSdCommand + 514 * nanosSdByte);
+  nBlocksRead++;
+
+  for (size_t iFile = 0; iFile < _files.size(); ++iFile) {
+    SimFile& file = *_files[iFile];
+
+    if (block < file.blockFirst || block >= file.blockFirst + (file.data.size() + 511) / 512)
+      continue;
+
+    uint32_t position = (block - file.blockFirst) * 512 + offset;
+
+    for (uint16_t iByte = 0; iByte < count; ++iByte)
+      bytes[iByte] = (position + iByte < file.data.size() ? file.data[position + iByte] : 0);
+
+    file.positionCard = position + count;
+
+    return true;
+  }
+
+  memset(bytes, 0, count);
+
+  return true;
+}
+
+
+void Simulator::attach(SimDecoder& decoder)
+{
+  for (size_t iDecoder = 0; iDecoder < _nDecoders; ++iDecoder) {
+    if (_decoders[iDecoder] == &decoder)
+      return;
+  }
+
+  if (_nDecoders < DECODERS_MAX) {
+    _requestPrev[_nDecoders] = decoder.request();
+    _decoders[_nDecoders++] = &decoder;
+  }
+
+  decoder.update(_nanos);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Arduino (implementation)
+//
+
+unsigned long millis()
+{
+  Sim.elapse(Sim.nanosClock);
+  return (unsigned long) (Sim.nanos() / 1000000);
+}
+
+
+unsigned long micros()
+{
+  Sim.elapse(Sim.nanosClock);
+  return (unsigned long) (Sim.nanos() / 1000);
+}
+
+
+void delay(unsigned long msec)
+{
+  Sim.elapse((uint64_t) msec * 1000000);
+}
+
+
+void delayMicroseconds(unsigned int usec)
+{
+  Sim.elapse((uint64_t) usec * 1000);
+}
+
+
+void pinMode(uint8_t address, uint8_t mode)
+{
+  Sim.pinMode(address, mode);
+}
+
+
+void digitalWrite(uint8_t address, uint8_t value)
+{
+  Sim.digitalWrite(address, value);
+}
+
+
+int digitalRead(uint8_t address)
+{
+  return Sim.digitalRead(address);
+}
+
+
+int analogRead(uint8_t address)
+{
+  (void) address;
+
+  Sim.elapse(112000);
+  return 0;
+}
+
+
+void analogWrite(uint8_t address, int value)
+{
+  (void) address;
+  (void) value;
+}
+
+
+void noInterrupts()
+{
+  Sim.enableInterrupts(false);
+}
+
+
+void interrupts()
+{
+  Sim.enableInterrupts(true);
+}
+
+
+uint8_t volatile PCICR;
+uint8_t volatile PCMSK0;
+uint8_t volatile PCMSK1;
+uint8_t volatile PCMSK2;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SPDR, SPSR, SPCR (implementation)
+//
+
+RegisterSPDR SPDR;
+RegisterSPSR SPSR;
+uint8_t      SPCR;
+
+
+RegisterSPDR& RegisterSPDR::operator = (uint8_t value)
+{
+  Sim.spcr = SPCR;
+  _value = Sim.transfer(value);
+  return *this;
+}
+
+
+RegisterSPDR::operator uint8_t () const
+{
+  return _value;
+}
+
+
+RegisterSPSR& RegisterSPSR::operator = (uint8_t value)
+{
+  _value = value & _BV(SPI2X);
+  Sim.spsr = _value;
+  return *this;
+}
+
+
+RegisterSPSR::operator uint8_t () const
+{
+  return _value | _BV(SPIF);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SPISettings (implementation)
+//
+
+SPISettings::SPISettings()
+{
+  init(4000000);
+}
+
+
+SPISettings::SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode)
+{
+  (void) bitOrder;
+  (void) dataMode;
+
+  init(clock);
+}
+
+
+void SPISettings::init(uint32_t clock)
+{
+  // the fastest of F_CPU/2 through F_CPU/128 that is no faster than asked
+  // for, encoded like SPI_CLOCK_DIV2 through SPI_CLOCK_DIV128
+
+  static uint8_t const dividers[7] = {
+    SPI_CLOCK_DIV2,  SPI_CLOCK_DIV4,  SPI_CLOCK_DIV8,  SPI_CLOCK_DIV16,
+    SPI_CLOCK_DIV32, SPI_CLOCK_DIV64, SPI_CLOCK_DIV128 };
+
+  size_t iDivider = 0;
+
+  while (iDivider < 6 && (8000000UL >> iDivider) > clock)
+    ++iDivider;
+
+  _spcr = dividers[iDivider] & 0x3;
+  _spsr = (dividers[iDivider] & 0x4 ? _BV(SPI2X) : 0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SPIClass (implementation)
+//
+
+SPIClass SPI;
+
+
+void SPIClass::begin()
+{
+  // nothing to do
+}
+
+
+uint8_t SPIClass::transfer(uint8_t value)
+{
+  Sim.spcr = SPCR;
+  Sim.elapse(Sim.nanosTransferCall);
+  return Sim.transfer(value);
+}
+
+
+void SPIClass::usingInterrupt(uint8_t interruptNumber)
+{
+  (void) interruptNumber;
+}
+
+
+void SPIClass::beginTransaction(SPISettings settings)
+{
+  Sim.elapse(Sim.nanosTransaction);
+
+  SPCR = (SPCR & ~0x3) | settings._spcr;
+  SPSR = settings._spsr;
+}
+
+
+void SPIClass::endTransaction()
+{
+  // nothing to do
+}
+
+
+void SPIClass::setBitOrder(uint8_t order)
+{
+  (void) order;
+}
+
+
+void SPIClass::setDataMode(uint8_t mode)
+{
+  (void) mode;
+}
+
+
+void SPIClass::setClockDivider(uint8_t divider)
+{
+  SPCR = (SPCR & ~0x3) | (divider & 0x3);
+  SPSR = (divider & 0x4 ? _BV(SPI2X) : 0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File, Sd2Card, SdFile (implementation)
+//
+
+File::File()
+  : _file (0)
+{
+  // nothing else to do
+}
+
+
+File::File(SimFile* file)
+  : _file (file)
+{
+  // nothing else to do
+}
+
+
+int File::read(void* bytes, uint16_t nBytes)
+{
+  if (!_file)
+    return -1;
+
+  return Sim.readFile(*_file, (uint8_t*) bytes, nBytes);
+}
+
+
+size_t File::write(uint8_t const* bytes, size_t nBytes)
+{
+  if (!_file)
+    return 0;
+
+  return Sim.writeFile(*_file, bytes, nBytes);
+}
+
+
+void File::flush()
+{
+  if (_file)
+    Sim.flushFile(*_file);
+}
+
+
+int File::available()
+{
+  return (_file ? _file->data.size() - _file->position : 0);
+}
+
+
+int File::read()
+{
+  uint8_t value;
+  return (read(&value, 1) == 1 ? value : -1);
+}
+
+
+int File::peek()
+{
+  if (!_file || _file->position >= _file->data.size())
+    return -1;
+
+  return _file->data[_file->position];
+}
+
+
+bool File::seek(uint32_t position)
+{
+  return (_file ? Sim.seekFile(*_file, position) : false);
+}
+
+
+uint32_t File::position()
+{
+  return (_file ? _file->position : 0);
+}
+
+
+uint32_t File::size()
+{
+  return (_file ? _file->data.size() : 0);
+}
+
+
+File::operator bool ()
+{
+  return (_file != 0);
+}
+
+
+uint8_t Sd2Card::readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst)
+{
+  return (Sim.readCard(block, offset, count, dst) ? 1 : 0);
+}
+
+
+SdFile::SdFile()
+  : _file (0)
+{
+  // nothing else to do
+}
+
+
+SdFile::SdFile(SimFile* file)
+  : _file (file)
+{
+  // nothing else to do
+}
+
+
+uint8_t SdFile::contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock)
+{
+  if (!_file)
+    return 0;
+
+  *bgnBlock = _file->blockFirst;
+  *endBlock = _file->blockFirst + (_file->data.size() + 511) / 512 - 1;
+
+  return 1;
+}
+
+
+uint32_t SdFile::curPosition() const
+{
+  return (_file ? _file->position : 0);
+}
+
+
+uint32_t SdFile::fileSize() const
+{
+  return (_file ? _file->data.size() : 0);
+}
@@ -0,0 +1,351 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side simulation of a VS1053b-based expansion board, for running
+//  the Music library on a Linux machine against a virtual clock.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include <Arduino.h>
+#include <SD.h>
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SimDecoder
+//
+//  Models the parts of the VS1053b that the Music library talks to: the SCI
+//  registers, WRAM with auto-increment, and the 2048-byte SDI FIFO that is
+//  drained at a configurable byte rate while decoding. DREQ is high whenever
+//  at least 32 bytes are free in the FIFO, except while the chip is in reset
+//  or still executing an SCI write. After a software reset with SM_ADPCM
+//  set, it records instead: IMA ADPCM words at the rate that SCI_AICTRL0
+//  asks for pile up in a 1024-word buffer until read from SCI_HDAT0. Bytes
+//  clocked faster than the internal clock set in SCI_CLOCKF allows are
+//  counted, but not garbled. Time spent idle on the bare XTALI clock with
+//  SCI_VOL at 0xFFFF (analog powerdown) is added up. An ID3v2 tag in front
+//  of a stream is skimmed over like end fill bytes; any other tag is
+//  decoded as if it were audio.
+//
+//  A plugin started by writing SCI_AIADDR is taken to be VLSI's PCM mixer
+//  if mixerRate is set: samples written to SCI_AICTRL2 go into a 512-word
+//  FIFO that drains at mixerRate, and SCI_AICTRL1 reads as the room left.
+//
+//  With hung set, DREQ never comes back up, like with a chip that isn't
+//  there or doesn't come out of reset.
+//
+
+class SimDecoder
+{
+public:
+  SimDecoder();
+
+  void begin(
+    uint8_t addressPinReset         = A0,
+    uint8_t addressPinRequest       = A1,
+    uint8_t addressPinSelectData    = A2,
+    uint8_t addressPinSelectControl = A3);
+
+  // configuration
+
+  unsigned long byteRate;      // bytes per second consumed while decoding
+  unsigned long byteRateFast;  // bytes per second discarded while cancelling
+  uint16_t      nBytesCancel;  // bytes discarded until SM_CANCEL clears
+  bool          positionMsec;  // report positionMsec like for WMA, AAC and Ogg, or -1 like for MP3
+  unsigned long mixerRate;     // samples per second that a running PCM mixer plugin mixes in, or 0 for no such plugin
+  bool          hung;          // keep DREQ low no matter what
+
+  // statistics, reset by clearStatistics()
+
+  unsigned long nBytesData;       // bytes received over SDI
+  unsigned long nBytesTaken;      // bytes taken out of the FIFO, decoded or dropped
+  unsigned long nBytesTag;        // bytes of ID3v2 tags skimmed over in front of a stream
+  unsigned long nBytesOverrun;    // bytes received over SDI while the FIFO was full
+  unsigned long nUnderruns;       // times the FIFO ran dry in the middle of a stream
+  uint64_t      nanosUnderrun;    // total time without data in the middle of a stream
+  uint64_t      nanosMarginMin;   // least audio left in the FIFO once it had filled up
+  uint64_t      nanosGap;         // total time between the last audio of one stream and the first of the next
+  unsigned long nStreams;         // streams started
+  uint64_t      nanosStream;      // when the latest stream started
+  unsigned long nCancels;         // streams ended by SM_CANCEL
+  unsigned long nResets;          // hardware and software resets
+  unsigned long nSciReads;        // SCI words read
+  unsigned long nSciWrites;       // SCI words written
+  unsigned long nSciEarly;        // SCI words written before the previous write was done
+  unsigned long nBytesTooFast;    // bytes clocked faster than CLKI/4 (SDI, SCI writes) or CLKI/7 (SCI reads) allows
+  unsigned long nVolumeWrites;     // writes to SCI_VOL
+  uint16_t      volumeStepMax;    // largest change of either channel's attenuation in one write to SCI_VOL, short of silence
+  unsigned long nWordsEncoded;    // words produced while recording
+  unsigned long nWordsRead;       // words read from SCI_HDAT0 while recording
+  unsigned long nWordsLost;       // words dropped because the recording buffer was full
+  unsigned long nWordsBacklogMax; // most words ever waiting in the recording buffer
+  uint64_t      nanosPowerDown;   // total time idle with the clock at XTALI and the analog side powered down
+  unsigned long nMixerSamples;    // samples received by the PCM mixer
+  unsigned long nMixerOverruns;   // samples received by the PCM mixer while its FIFO was full
+  uint64_t      nanosMixerFirst;  // when the PCM mixer received its first sample
+  uint64_t      nanosMixerEmpty;  // when the PCM mixer's FIFO last ran empty
+
+  void clearStatistics();
+
+  bool decoding() const;
+  bool recording() const;
+  unsigned long msecDecoded() const;
+
+  uint16_t registers[16];
+  std::vector<uint16_t> memory;
+
+  // called by the simulator
+
+  void update(uint64_t nanos);
+
+  bool request() const;
+
+  void pin(uint8_t address, uint8_t value);
+  uint8_t transfer(uint8_t value, unsigned long hzSpi);
+
+  uint8_t addressPinReset;
+  uint8_t addressPinRequest;
+  uint8_t addressPinSelectData;
+  uint8_t addressPinSelectControl;
+
+private:
+  static size_t const FIFO_SIZE   = 2048;
+  static size_t const RECORD_SIZE = 1024;
+  static size_t const MIXER_SIZE  = 512;
+
+  enum State {
+    STATE_IDLE,
+    STATE_DECODING,
+    STATE_RECORDING,
+  };
+
+  void reset(uint64_t nanosBusy);
+
+  uint16_t readRegister(uint8_t address);
+  void writeRegister(uint8_t address, uint16_t value);
+
+  uint16_t readMemory(uint16_t address);
+
+  unsigned long hzClock() const;
+
+  void receive(uint8_t value);
+  void consume(uint8_t value);
+
+  uint32_t tagSize() const;
+
+  State _state;
+
+  bool _reset;
+  bool _selectData;
+  bool _selectControl;
+
+  uint64_t _nanos;
+  uint64_t _nanosBusyUntil;
+  uint64_t _nanosRemainder;
+
+  uint8_t  _fifo[FIFO_SIZE];
+  size_t   _fifoHead;
+  size_t   _fifoLength;
+  uint32_t _nBytesTagRemaining;
+  bool     _primed;
+  bool     _underrun;
+
+  bool     _cancel;
+  uint16_t _nBytesCancelRemaining;
+
+  bool     _audio;
+  uint64_t _nanosAudio;
+
+  unsigned long _nBytesFill;
+  unsigned long _nBytesDecoded;
+  uint16_t      _decodeTime;
+
+  size_t   _recordLength;
+  uint64_t _recordRemainder;
+  uint16_t _recordWord;
+
+  bool     _mixer;
+  size_t   _mixerLength;
+  uint64_t _mixerRemainder;
+
+  uint8_t  _sciIndex;
+  uint8_t  _sciOpcode;
+  uint8_t  _sciAddress;
+  uint16_t _sciValue;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SimFile
+//
+//  A file on the simulated SD card. Files are laid out contiguously on the
+//  card in the order they are created, and listed in its directory in that
+//  order, too.
+//
+
+class SimFile
+{
+public:
+  explicit SimFile(size_t nBytes);
+
+  std::vector<uint8_t> data;
+
+  uint32_t position;
+  uint32_t positionCard;  // just past what was last read straight from the card
+  uint32_t blockFirst;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  SimStream
+//
+//  A connection over which a sender pushes a file's bytes at up to a given
+//  byte rate into a receive buffer of a given size (64 bytes for a USB
+//  serial port), and waits while it is full - like USB or TCP would.
+//
+
+class SimStream : public Stream
+{
+public:
+  SimStream(SimFile& file, unsigned long byteRate, size_t nBytesBuffer);
+
+  virtual int available();
+  virtual int read();
+  virtual int peek();
+
+private:
+  void update();
+
+  SimFile&      _file;
+  unsigned long _byteRate;
+  size_t        _nBytesBuffer;
+  uint64_t      _nanosPrev;
+  uint64_t      _nanosRemainder;
+
+  std::deque<uint8_t> _buffer;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Simulator
+//
+
+class Simulator
+{
+public:
+  Simulator();
+
+  // virtual clock
+
+  uint64_t nanos() const;
+  void elapse(uint64_t nanos);
+
+  // cost of individual operations on a 16 MHz AVR
+
+  uint64_t nanosDigital;          // digitalRead(), digitalWrite()
+  uint64_t nanosClock;            // millis(), micros()
+  uint64_t nanosTransferCall;     // SPI.transfer() on top of the time on the wire
+  uint64_t nanosTransaction;      // SPI.beginTransaction() and SPI.endTransaction() together
+  uint64_t nanosSdCall;           // File::read() and File::seek() in the SD library
+  uint64_t nanosStreamCall;       // Stream::available(), Stream::read() on a serial port
+  uint64_t nanosSdCommand;        // issuing a block read to the card
+  uint64_t nanosSdByte;           // clocking one byte in from the card
+  uint64_t nanosSdCopyByte;       // copying one byte out of the SD library's cache
+  uint64_t nanosSdProgram;        // the card being busy after a block was written to it
+  uint64_t nanosSdStall;          // the card being busy with housekeeping once in a while
+  uint32_t nBlocksPerStall;       // blocks written between two such stalls
+  uint32_t nBlocksPerCluster;     // FAT cluster size
+
+  // pins
+
+  void pinMode(uint8_t address, uint8_t mode);
+  void digitalWrite(uint8_t address, uint8_t value);
+  uint8_t digitalRead(uint8_t address);
+
+  // SPI bus
+
+  uint8_t transfer(uint8_t value);
+  uint64_t nanosPerByte() const;
+  unsigned long hzSpi() const;
+
+  uint8_t spcr;
+  uint8_t spsr;
+
+  unsigned long nBytesCollision;  // SPI bytes sent with more than one slave selected
+
+  // SD card
+
+  SimFile* createFile(size_t nBytes);
+  SimFile* openFile(size_t index);
+  void formatCard();
+
+  int readFile(SimFile& file, uint8_t* bytes, size_t nBytes);
+  int writeFile(SimFile& file, uint8_t const* bytes, size_t nBytes);
+  void flushFile(SimFile& file);
+  bool seekFile(SimFile& file, uint32_t position);
+  bool readCard(uint32_t block, uint16_t offset, uint16_t count, uint8_t* bytes);
+
+  unsigned long nBlocksRead;
+  unsigned long nBlocksWritten;
+
+  // interrupts
+
+  void (*handlerPinChange)();
+
+  void enableInterrupts(bool enable);
+
+  unsigned long nInterrupts;
+
+  // decoders
+
+  void attach(SimDecoder& decoder);
+
+private:
+  static size_t const DECODERS_MAX = 4;
+  static size_t const PINS_MAX     = 32;
+
+  void readBlock(uint32_t block);
+  void writeBlock();
+
+  void checkPinChange();
+
+  uint64_t _nanos;
+
+  bool _interruptsEnabled;
+  bool _interruptPending;
+  bool _interruptActive;
+
+  bool _requestPrev[DECODERS_MAX];
+
+  uint8_t _pins[PINS_MAX];
+
+  SimDecoder* _decoders[DECODERS_MAX];
+  size_t _nDecoders;
+
+  std::vector<SimFile*> _files;
+  uint32_t _blockNext;
+  uint32_t _blockCached;
+  bool     _blockDirty;
+};
+
+
+extern Simulator Sim;
+
+
+#endif
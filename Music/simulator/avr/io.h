@@ -0,0 +1,66 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side stand-in for the AVR SPI registers, backed by the simulator.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#ifndef AVR_IO_H
+#define AVR_IO_H
+
+#include <stdint.h>
+
+
+#define _BV(bit) (1 << (bit))
+
+#define SPIF   7
+#define SPI2X  0
+
+#define SPR0   0
+#define SPR1   1
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  RegisterSPDR
+//  RegisterSPSR
+//
+//  Writing SPDR shifts a byte out over the simulated bus and completes the
+//  transfer right away (advancing the simulated clock by its time on the
+//  wire), so SPIF always reads as set.
+//
+
+class RegisterSPDR
+{
+public:
+  RegisterSPDR& operator = (uint8_t value);
+  operator uint8_t () const;
+
+private:
+  uint8_t _value;
+};
+
+
+class RegisterSPSR
+{
+public:
+  RegisterSPSR& operator = (uint8_t value);
+  operator uint8_t () const;
+
+private:
+  uint8_t _value;
+};
+
+
+extern RegisterSPDR SPDR;
+extern RegisterSPSR SPSR;
+extern uint8_t      SPCR;
+
+
+#endif
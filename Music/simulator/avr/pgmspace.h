@@ -0,0 +1,31 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Host-side stand-in for AVR program memory access.
+//
+//  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+//
+//  Licensed under a Creative Commons Attribution 3.0 Unported License and
+//  distributed in the hope that it will be useful, but without any warranty.
+//
+//  See <http://creativecommons.org/licenses/by/3.0/> for details.
+//
+
+
+#ifndef AVR_PGMSPACE_H
+#define AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+#define PROGMEM
+
+#define PSTR(string) (string)
+
+#define pgm_read_byte(address)  (*(uint8_t  const*) (address))
+#define pgm_read_word(address)  (*(uint16_t const*) (address))
+
+#define memcpy_P(dest, source, nBytes)  memcpy((dest), (source), (nBytes))
+
+
+#endif
@@ -0,0 +1,137 @@
+#!/usr/bin/perl
+
+##############################################################################
+#
+#  Packs audio files into a sound bank for CMusic::playBank().
+#
+#  Usage: music-bank.pl bank.bnk clip0.mp3 clip1.mp3 ...
+#
+#  The bank starts with "MBNK", the number of clips (16 bits) and two
+#  reserved bytes, followed by an 8-byte entry per clip: where its audio
+#  starts in the bank and how many bytes it has (32 bits each), all
+#  little-endian. Each clip starts on a 512-byte block of its own, so that
+#  the first read from the SD card gets a whole block of it. Tags are left
+#  out: ID3v2 in front, ID3v1 and APEv2 behind, like the library skips
+#  them when playing a file.
+#
+#  Prints each clip's index, which is what playBank() takes, in the order
+#  the files were given.
+#
+#  (C) 2013 Michael Buschbeck <michael@buschbeck.net>
+#
+#  Licensed under a Creative Commons Attribution 3.0 Unported License and
+#  distributed in the hope that it will be useful, but without any warranty.
+#
+#  See <http://creativecommons.org/licenses/by/3.0/> for details.
+#
+
+use strict;
+use warnings;
+
+
+my $nBytesBlock = 512;
+
+my $fileBank = shift;
+my @fileClip = @ARGV;
+
+die "Usage: $0 bank.bnk clip0.mp3 clip1.mp3 ...\n"
+  unless defined $fileBank && @fileClip;
+
+die "ERROR: at most 65535 clips fit in a bank\n"
+  if @fileClip > 65535;
+
+
+sub read_file
+{
+  my ($file) = @_;
+
+  open my $handle, '<:raw', $file
+    or die "ERROR: can't read $file: $!\n";
+
+  local $/;
+  my $data = <$handle>;
+
+  close $handle;
+
+  return (defined $data ? $data : '');
+}
+
+
+sub strip_tags
+{
+  my ($data) = @_;
+
+  # ID3v2 in front: its size is a syncsafe integer, seven bits per byte,
+  # and doesn't count the 10-byte header or a 10-byte footer
+
+  if (length($data) >= 10) {
+    my ($magic, $versionMajor, $versionMinor, $flags, @size) = unpack 'a3 C C C C4', $data;
+
+    if ($magic eq 'ID3'
+        && $versionMajor != 0xFF && $versionMinor != 0xFF
+        && !grep { $_ & 0x80 } @size) {
+      my $nBytesTag = 10 + (($size[0] << 21) | ($size[1] << 14) | ($size[2] << 7) | $size[3]);
+      $nBytesTag += 10 if $flags & 0x10;
+
+      $data = ($nBytesTag < length($data) ? substr($data, $nBytesTag) : '');
+    }
+  }
+
+  # ID3v1 in the last 128 bytes
+
+  $data = substr($data, 0, -128)
+    if length($data) >= 128 && substr($data, -128, 3) eq 'TAG';
+
+  # APEv2 before that: its footer tells the size of its items plus itself,
+  # and whether a 32-byte header precedes them
+
+  if (length($data) >= 32 && substr($data, -32, 8) eq 'APETAGEX') {
+    my ($nBytesTag, $flags) = unpack 'x12 V x4 V', substr($data, -32);
+    $nBytesTag += 32 if $flags & 0x80000000;
+
+    $data = substr($data, 0, -$nBytesTag)
+      if $nBytesTag <= length($data);
+  }
+
+  return $data;
+}
+
+
+my @clip = map { strip_tags(read_file($_)) } @fileClip;
+
+for (my $iClip = 0; $iClip < @clip; ++$iClip) {
+  die "ERROR: no audio in $fileClip[$iClip]\n"
+    if length($clip[$iClip]) == 0;
+}
+
+
+# header and index, padded to the first clip's block
+
+my $nBytesIndex = 8 + 8 * @clip;
+my $offset = int(($nBytesIndex + $nBytesBlock - 1) / $nBytesBlock) * $nBytesBlock;
+
+my $index = pack 'a4 v v', 'MBNK', scalar(@clip), 0;
+my $body  = '';
+
+for (my $iClip = 0; $iClip < @clip; ++$iClip) {
+  my $nBytes = length($clip[$iClip]);
+  my $nBytesPadded = int(($nBytes + $nBytesBlock - 1) / $nBytesBlock) * $nBytesBlock;
+
+  $index .= pack 'V V', $offset, $nBytes;
+  $body  .= $clip[$iClip] . ("\0" x ($nBytesPadded - $nBytes));
+
+  printf "%5d  %10d  %8d  %s\n", $iClip, $offset, $nBytes, $fileClip[$iClip];
+
+  $offset += $nBytesPadded;
+}
+
+$index .= "\0" x (int(($nBytesIndex + $nBytesBlock - 1) / $nBytesBlock) * $nBytesBlock - $nBytesIndex);
+
+
+open my $handle, '>:raw', $fileBank
+  or die "ERROR: can't write $fileBank: $!\n";
+
+print $handle $index, $body;
+
+close $handle
+  or die "ERROR: can't write $fileBank: $!\n";
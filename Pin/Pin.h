@@ -34,6 +34,8 @@ public:
   void begin(uint8_t address);
   void begin(uint8_t address, uint8_t value);
 
+  uint8_t address() const;
+
   operator uint8_t ();
 
   PinDigital& operator = (uint8_t value);
@@ -216,6 +218,13 @@ inline void PinDigital<MODE>::begin(uint8_t address, uint8_t value)
 }
 
 
+template<uint8_t MODE>
+inline uint8_t PinDigital<MODE>::address() const
+{
+  return _address;
+}
+
+
 template<uint8_t MODE>
 inline PinDigital<MODE>::operator uint8_t ()
 {